@@ -0,0 +1,407 @@
+#include "turtle-graphics.h"
+
+//the checks ./turtle-graphics --test runs, any that fails stops the program through assert
+
+void test_far_lines(void);
+void test_raster_modes(void);
+void test_far_moves(void);
+void test_sparse_edges(void);
+TTLStatus write_empty(bool sparse, FILE* wp);
+void test_set_folding(void);
+void set_result(const char* set, TTLStatus* status, double values[3], int* items);
+void test_record_replay(void);
+bool same_file(FILE* a, FILE* b);
+void test_server(void);
+void* test_serve(void* arg);
+bool same_cells(Canvas* a, Canvas* b);
+TTLStatus run_text(TTLEngine* engine, const char* source);
+
+void test(){
+    test_far_lines();
+    test_raster_modes();
+    test_far_moves();
+    test_sparse_edges();
+    test_set_folding();
+    test_record_replay();
+    test_server();
+    printf("all tests passed\n");
+}
+
+//a line through the middle of the grid with its ends 2^39 cells away has the same slope as a
+//short one through the same cells, so both have to plot exactly the same cells. the products in
+//the clipping used to pass 64 bits out there
+void test_far_lines(void){
+    const int slopes[][2] = {{1, 1}, {3, 1}, {1, 3}, {-5, 2}, {2, -7}, {-4, -3}};
+    const long long far = 1LL << 39;
+    Canvas near_grid;
+    Canvas far_grid;
+
+    memset(&near_grid, 0, sizeof(Canvas));
+    memset(&far_grid, 0, sizeof(Canvas));
+    assert(canvas_init(&near_grid, 40, 30, false) && canvas_init(&far_grid, 40, 30, false));
+    for (size_t i = 0; i < sizeof(slopes) / sizeof(slopes[0]); i++){
+        long long a = slopes[i][0];
+        long long b = slopes[i][1];
+        canvas_clear(&near_grid);
+        canvas_clear(&far_grid);
+        raster_line(&near_grid, 20 - 64 * a, 15 - 64 * b, 20 + 64 * a, 15 + 64 * b, 'W');
+        raster_line(&far_grid, 20 - far * a, 15 - far * b, 20 + far * a, 15 + far * b, 'W');
+        assert(same_cells(&near_grid, &far_grid));
+
+        for (int top = 0; top < 30; top += 8){ //raster threads only draw their own band of rows
+            far_grid.band_top = top;
+            far_grid.band_bottom = (top + 8 < 30) ? top + 8 : 30;
+            raster_line(&far_grid, 20 - far * a, 15 - far * b, 20 + far * a, 15 + far * b, 'R');
+        }
+        far_grid.band_top = 0;
+        far_grid.band_bottom = 30;
+        raster_line(&near_grid, 20 - 64 * a, 15 - 64 * b, 20 + 64 * a, 15 + 64 * b, 'R');
+        assert(same_cells(&near_grid, &far_grid));
+    }
+    canvas_free(&near_grid);
+    canvas_free(&far_grid);
+}
+
+//the integer rasterizer puts point i of a line exactly at i / steps of the way, the original float
+//stepping adds up 1/3 and falls just short of 5 at (5, 10) and of 6 at (6, 13). --legacy-raster
+//has to keep the original cells
+void test_raster_modes(void){
+    const int columns[2][12] = { //column drawn in rows 4 to 15, exact and then --legacy-raster
+        {3, 3, 3, 4, 4, 4, 5, 5, 5, 6, 6, 6},
+        {3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 6, 6}
+    };
+    char row[20];
+
+    for (int mode = 0; mode <= 1; mode++){
+        TTLOptions options;
+        ttl_default_options(&options);
+        options.legacy_raster = mode;
+        TTLEngine* engine = ttl_engine_create(&options);
+        Canvas g;
+        memset(&g, 0, sizeof(Canvas));
+        assert((engine != NULL) && canvas_init(&g, 20, 20, false));
+
+        draw_segment(engine, &g, 3, 4, 7, 16, 'W');
+        for (int y = 0; y < 20; y++){
+            int column = ((y >= 4) && (y < 16)) ? columns[mode][y - 4] : -1; //the only cell drawn in this row
+            canvas_row(&g, 0, y, 20, row);
+            for (int x = 0; x < 20; x++){
+                assert((row[x] != '\0') == (x == column));
+            }
+        }
+        canvas_free(&g);
+        ttl_engine_destroy(engine);
+    }
+}
+
+//moves far past the grid stop at MAX_POSITION instead of overflowing, with and without --fixed
+void test_far_moves(void){
+    char source[4096] = "START\n";
+    for (int i = 0; i < 20; i++){
+        strcat(source, "FORWARD 1000000000\n");
+    }
+    strcat(source, "RIGHT 179.9\n");
+    for (int i = 0; i < 20; i++){
+        strcat(source, "FORWARD 1000000000\nFORWARD 1e300\n");
+    }
+    strcat(source, "RIGHT 90\nFORWARD -1e300\nEND\n");
+
+    for (int fixed = 0; fixed <= 1; fixed++){
+        TTLOptions options;
+        ttl_default_options(&options);
+        options.fixed = fixed;
+        TTLEngine* engine = ttl_engine_create(&options);
+        assert(engine != NULL);
+        assert(run_text(engine, source) == TTL_OK);
+        assert(fabs(engine->turtle->x) <= MAX_POSITION && fabs(engine->turtle->y) <= MAX_POSITION);
+        ttl_engine_destroy(engine);
+    }
+}
+
+//cells either side of a tile edge at negative coordinates land in the right tile and cell. an
+//empty sparse canvas writes out the --size grid, and one too wide to write fails instead of
+//cutting its width down to an int
+void test_sparse_edges(void){
+    const long long cells[][2] = {{-1, -1}, {0, 0}, {-TILE_SIZE, 3}, {-TILE_SIZE - 1, 3}, {TILE_SIZE - 1, -TILE_SIZE},
+                                  {TILE_SIZE, -TILE_SIZE - 1}, {-3 * TILE_SIZE + 1, -2 * TILE_SIZE}};
+    const int ncells = sizeof(cells) / sizeof(cells[0]);
+    Canvas g;
+    char row[5];
+
+    memset(&g, 0, sizeof(Canvas));
+    assert(sparse_init(&g, 10, 10));
+    for (int i = 0; i < ncells; i++){
+        canvas_plot(&g, cells[i][0], cells[i][1], 'A' + i);
+    }
+    for (int i = 0; i < ncells; i++){
+        for (long long y = cells[i][1] - 2; y <= cells[i][1] + 2; y++){
+            canvas_row(&g, cells[i][0] - 2, y, 5, row);
+            for (int x = 0; x < 5; x++){
+                char expected = '\0';
+                for (int j = 0; j < ncells; j++){
+                    if ((cells[j][0] == cells[i][0] - 2 + x) && (cells[j][1] == y)){
+                        expected = 'A' + j;
+                    }
+                }
+                assert(row[x] == expected);
+            }
+        }
+    }
+    assert((g.min_x == -3 * TILE_SIZE + 1) && (g.max_x == TILE_SIZE) && (g.min_y == -2 * TILE_SIZE) && (g.max_y == 3));
+    canvas_free(&g);
+
+    FILE* dense = tmpfile();
+    FILE* sparse = tmpfile();
+    assert((dense != NULL) && (sparse != NULL));
+    assert((write_empty(false, dense) == TTL_OK) && (write_empty(true, sparse) == TTL_OK));
+    assert(same_file(dense, sparse));
+    fclose(dense);
+    fclose(sparse);
+
+    TTLOptions options;
+    TTLError error;
+    ttl_default_options(&options);
+    options.sparse = true;
+    TTLEngine* engine = ttl_engine_create(&options);
+    FILE* wp = tmpfile();
+    assert((engine != NULL) && (wp != NULL));
+    assert(run_text(engine, "START\nEND\n") == TTL_OK);
+    canvas_plot(&engine->turtle->grid, -1, 0, 'W');
+    canvas_plot(&engine->turtle->grid, INT_MAX, 0, 'W'); //INT_MAX + 1 cells wide
+    assert(ttl_engine_write(engine, wp, &error) == TTL_ERR_IO);
+    assert(ftell(wp) == 0);
+    fclose(wp);
+    ttl_engine_destroy(engine);
+}
+
+//run a program that draws nothing and write it out as text
+TTLStatus write_empty(bool sparse, FILE* wp){
+    TTLOptions options;
+    TTLError error;
+    ttl_default_options(&options);
+    options.sparse = sparse;
+    TTLEngine* engine = ttl_engine_create(&options);
+    assert((engine != NULL) && (run_text(engine, "START\nEND\n") == TTL_OK));
+    TTLStatus status = ttl_engine_write(engine, wp, &error);
+    ttl_engine_destroy(engine);
+    return status;
+}
+
+//a SET with the numbers written out has its constant operations worked out when it is compiled,
+//the same SET with the numbers in variables works them all out at run time. both have to give
+//the same values, leave the same stack for the next SET and fail the same way
+void test_set_folding(void){
+    const char* sets[][2] = { //written out and through variables, P=2 Q=3 R=4 S=0 T=7
+        {"SET A ( 2 3 + 4 * )", "SET A ( $P $Q + $R * )"},
+        {"SET A ( 7 4 - 3 / 2 2 * + )", "SET A ( $T $R - $Q / $P $P * + )"},
+        {"SET A ( 3 -2 - )", "SET A ( $Q -2 - )"},
+        {"SET A ( 1 2 3 + )", "SET A ( 1 $P $Q + )"}, //1 is left on the stack
+        {"SET A ( 5 + 2 3 * )", "SET A ( 5 + $P $Q * )"}, //takes the 1 the first SET A left
+        {"SET A ( 2 3 4 + * 7 - )", "SET A ( $P $Q $R + * $T - )"},
+        {"SET A ( 7 0 / )", "SET A ( $T $S / )"}, //never folded, has to fail at run time
+        {"SET A ( 4 0.5 / )", "SET A ( $R 0.5 / )"} //0.5 is 0 as an int, so also left for run time
+    };
+    const bool folds[] = {true, true, true, true, true, true, false, false};
+
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++){
+        TTLStatus status[2];
+        double values[2][3];
+        int items[2];
+        for (int j = 0; j < 2; j++){
+            set_result(sets[i][j], &status[j], values[j], &items[j]);
+        }
+        assert(status[0] == status[1]);
+        assert(memcmp(values[0], values[1], sizeof(values[0])) == 0);
+        assert(folds[i] ? (items[0] < items[1]) : (items[0] == items[1]));
+    }
+}
+
+//run a SET for A after the variables it uses are set, and give back the status, the value of A,
+//the depth and top of the stack left for later SETs and how many items the program compiled to
+void set_result(const char* set, TTLStatus* status, double values[3], int* items){
+    char source[256];
+    TTLOptions options;
+    ttl_default_options(&options);
+    TTLEngine* engine = ttl_engine_create(&options);
+    assert(engine != NULL);
+
+    snprintf(source, sizeof(source), "START\nSET P ( 2 )\nSET Q ( 3 )\nSET R ( 4 )\nSET S ( 0 )\nSET T ( 7 )\n"
+             "SET A ( 1 0 )\n%s\nEND\n", set);
+    *status = run_text(engine, source);
+    values[0] = engine->variable[find_var('A')].value;
+    values[1] = engine->stack->top;
+    values[2] = (engine->stack->top == EMPTY_STACK) ? 0 : engine->stack->items[engine->stack->top];
+    *items = engine->program.nitems;
+    ttl_engine_destroy(engine);
+}
+
+//a frame log played back to its last frame has to give the same text as the output file, on the
+//grid and on a sparse canvas that grows past the --size grid on every side. the first frame is the
+//empty grid, written before anything is drawn
+void test_record_replay(void){
+    const char* source = "START\nLOOP C OVER { \"RED\" \"GREEN\" \"BLUE\" }\nCOLOUR $C\n"
+                         "LOOP A OVER 1 .. 8\nFORWARD 40\nRIGHT 135\nEND\nRIGHT 10\nEND\n"
+                         "COLOUR \"YELLOW\"\nFORWARD 2\nEND\n";
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/turtle-graphics-test-%d.log", (int)getpid());
+
+    for (int sparse = 0; sparse <= 1; sparse++){
+        TTLOptions options;
+        ttl_default_options(&options);
+        options.sparse = sparse;
+        options.record = ttl_record_open(path);
+        TTLEngine* engine = ttl_engine_create(&options);
+        FILE* output = tmpfile();
+        FILE* replayed = tmpfile();
+        TTLError error;
+        assert((options.record != NULL) && (engine != NULL) && (output != NULL) && (replayed != NULL));
+        assert(run_text(engine, source) == TTL_OK);
+        assert(ttl_engine_write(engine, output, &error) == TTL_OK);
+        ttl_engine_destroy(engine);
+        assert(fclose(options.record) == 0);
+
+        Replay r;
+        FILE* log = fopen(path, "r");
+        bool done = false;
+        assert((log != NULL) && replay_open(&r, log));
+        assert(replay_next(&r, &done) && !done && (r.frames == 1));
+        for (size_t i = 0; i < (size_t)r.width * r.height; i++){
+            assert(r.cells[i] == '\0');
+        }
+        while (!done){
+            assert(replay_next(&r, &done));
+        }
+        assert(r.frames > 2);
+        assert(write_cells(replayed, r.cells, r.width, r.height));
+        assert(same_file(output, replayed));
+
+        fclose(log);
+        fclose(output);
+        fclose(replayed);
+        free(r.cells);
+        free(r.line);
+    }
+    remove(path);
+}
+
+//a program sent to a server on a local socket has to come back exactly as it is written here, with
+//every option the RUN header carries, and a program that fails here has to fail there too
+void test_server(void){
+    const char* source = "START\nLOOP C OVER { \"RED\" \"CYAN\" }\nCOLOUR $C\nLOOP A OVER 1 .. 12\n"
+                         "FORWARD 30\nRIGHT 150\nEND\nRIGHT 45\nEND\nEND\n";
+    const char* failing = "START\nSET A ( 1 0 / )\nEND\n";
+    char program[64];
+    char output[64];
+    char socket_path[64];
+    Server server;
+    TTLOptions modes[8];
+
+    snprintf(program, sizeof(program), "/tmp/turtle-graphics-test-%d.ttl", (int)getpid());
+    snprintf(output, sizeof(output), "/tmp/turtle-graphics-test-%d.out", (int)getpid());
+    snprintf(socket_path, sizeof(socket_path), "/tmp/turtle-graphics-test-%d.sock", (int)getpid());
+    for (int m = 0; m < 8; m++){
+        ttl_default_options(&modes[m]);
+    }
+    modes[1].sparse = true;
+    modes[2].legacy_raster = true;
+    modes[2].width = 80;
+    modes[2].height = 20;
+    modes[3].viewport = true;
+    modes[3].view_x = -10;
+    modes[3].view_y = 5;
+    modes[3].view_width = 30;
+    modes[3].view_height = 12;
+    modes[4].format = TTL_FORMAT_RLE;
+    modes[4].fixed = true;
+    modes[5].format = TTL_FORMAT_PPM;
+    modes[5].scale = 3;
+    modes[6].format = TTL_FORMAT_PAM;
+    modes[6].packed = true;
+    modes[7].display_list = true;
+    modes[7].raster_threads = 3;
+
+    memset(&server, 0, sizeof(Server));
+    server.path = socket_path;
+    server.capacity = DEFAULT_QUEUE_SIZE;
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, test_serve, &server) == 0);
+    pthread_detach(thread);
+    struct sockaddr_un address;
+    assert(socket_address(socket_path, &address));
+    for (bool listening = false; !listening; ){ //the server is ready once a connection gets through
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(fd >= 0);
+        listening = (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+        close(fd);
+        if (!listening){
+            usleep(1000);
+        }
+    }
+
+    FILE* fp = fopen(program, "w");
+    assert((fp != NULL) && (fputs(source, fp) >= 0) && (fclose(fp) == 0));
+    char* files[] = {program, output};
+    for (int m = 0; m < 8; m++){
+        TTLEngine* engine = ttl_engine_create(&modes[m]);
+        FILE* here = tmpfile();
+        TTLError error;
+        assert((engine != NULL) && (here != NULL));
+        assert(run_text(engine, source) == TTL_OK);
+        assert(ttl_engine_write(engine, here, &error) == TTL_OK);
+        ttl_engine_destroy(engine);
+
+        assert(run_client(&server, &modes[m], 2, files, false) == EXIT_SUCCESS);
+        FILE* there = fopen(output, "rb");
+        assert((there != NULL) && same_file(here, there));
+        fclose(here);
+        fclose(there);
+    }
+
+    fp = fopen(program, "w");
+    assert((fp != NULL) && (fputs(failing, fp) >= 0) && (fclose(fp) == 0));
+    assert(run_client(&server, &modes[0], 2, files, false) == EXIT_FAILURE); //prints the server's error, as --connect does
+    remove(program);
+    remove(output);
+    remove(socket_path); //the server thread is left waiting in accept until the tests end
+}
+
+void* test_serve(void* arg){
+    TTLOptions options;
+    ttl_default_options(&options);
+    run_server(arg, &options, 2);
+    return NULL;
+}
+
+bool same_file(FILE* a, FILE* b){
+    char* data_a;
+    char* data_b;
+    size_t size_a;
+    size_t size_b;
+
+    rewind(a);
+    rewind(b);
+    assert((read_stream(a, &data_a, &size_a) == TTL_OK) && (read_stream(b, &data_b, &size_b) == TTL_OK));
+    bool same = (size_a == size_b) && (memcmp(data_a, data_b, size_a) == 0);
+    free(data_a);
+    free(data_b);
+    return same;
+}
+
+bool same_cells(Canvas* a, Canvas* b){
+    char row_a[MAX_CANVAS_SIZE];
+    char row_b[MAX_CANVAS_SIZE];
+
+    for (int y = 0; y < a->height; y++){
+        canvas_row(a, 0, y, a->width, row_a);
+        canvas_row(b, 0, y, a->width, row_b);
+        if (memcmp(row_a, row_b, a->width) != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+TTLStatus run_text(TTLEngine* engine, const char* source){
+    TTLError error;
+    return ttl_engine_run(engine, source, strlen(source), &error);
+}
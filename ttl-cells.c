@@ -0,0 +1,226 @@
+#include "turtle-graphics.h"
+#include "../neillsimplescreen.h"
+
+//cells of the grid as plain characters, shared by turtle-graphics, ttl-replay and ttl-viewer: TTLRLE
+//runs, the text grid, colours on the terminal and playing back frame logs
+
+neillcol find_neillcol(char col);
+
+//set cells from runs of a count and a colour letter, . is empty and a missing count is 1. empty
+//cells are set to empty. with fill set the cells after the last run are emptied too, otherwise
+//they are left alone. returns how many cells the runs covered, or -1 if they aren't valid
+int rle_decode(const char* line, char* cells, int width, char empty, bool fill){
+    int col = 0;
+
+    while (*line != '\0'){
+        long long run = 1;
+        if (isdigit((unsigned char)*line)){
+            char* end;
+            run = strtoll(line, &end, 10);
+            line = end;
+        }
+
+        char cell = *line++;
+        if ((cell != '.') && ((cell == '\0') || (strchr(CELL_COLOURS, cell) == NULL))){
+            return -1; //not a colour
+        }
+        if ((run < 1) || (run > width - col)){
+            return -1;
+        }
+        memset(cells + col, (cell == '.') ? empty : cell, run);
+        col += run;
+    }
+    if (fill){
+        memset(cells + col, empty, width - col); //the empty cells at the end of the row
+    }
+    return col;
+}
+
+//write n cells of a row to the terminal at row, col of the screen, in their colours
+void draw_cells(const char* cells, int row, int col, int n){
+    char colour = SCREEN_UNSET;
+
+    printf("\033[%d;%dH", row + 1, col + 1);
+    for (int i = 0; i < n; i++){
+        if (cells[i] != colour){
+            if (cells[i] == '\0'){
+                printf("\033[0m\033[%dm", BACKGROUND + 10);
+            }
+            else {
+                printf("\033[0m\033[%dm", find_neillcol(cells[i]));
+            }
+            colour = cells[i];
+        }
+        putchar((cells[i] == '\0') ? ' ' : cells[i]);
+    }
+}
+
+//write width by height cells in the same text print_grid writes
+bool write_cells(FILE* wp, const char* cells, int width, int height){
+    char* line = malloc((size_t)width + 1);
+    if (line == NULL){
+        return false;
+    }
+
+    bool written = true;
+    for (int row = 0; (row < height) && written; row++){
+        const char* here = cells + (size_t)row * width;
+        for (int col = 0; col < width; col++){
+            line[col] = (here[col] == '\0') ? ' ' : here[col];
+        }
+        line[width] = '\n';
+        written = (fwrite(line, 1, (size_t)width + 1, wp) == (size_t)width + 1);
+    }
+    free(line);
+    return written;
+}
+
+neillcol find_neillcol(char col){
+    if (col == 'K') {
+        return black; //return the appropriate neillcol for the character that was passed in
+    }
+    if (col == 'R') {
+        return red;
+    }
+    if (col == 'G') {
+        return green;
+    }
+    if (col == 'B') {
+        return blue;
+    }
+    if (col == 'Y') {
+        return yellow;
+    }
+    if (col == 'C') {
+        return cyan;
+    }
+    if (col == 'M') {
+        return magenta;
+    }
+    if (col == 'W') {
+        return white;
+    }
+    else{
+        return white;
+    }
+}
+
+bool replay_open(Replay* r, FILE* in){
+    memset(r, 0, sizeof(Replay));
+    r->in = in;
+    return (read_line(r) && samestr(r->line, "TTLLOG 1"));
+}
+
+//play the next frame, done is set once the log has run out
+bool replay_next(Replay* r, bool* done){
+    if (!r->pending && !read_line(r)){
+        *done = true;
+        return !ferror(r->in);
+    }
+    r->pending = false;
+
+    bool played = (r->line[0] == 'K') ? replay_keyframe(r) : samestr(r->line, "F") ? replay_delta(r) : false;
+    if (played){
+        r->frames++;
+        if (r->screen){
+            fflush(stdout);
+        }
+    }
+    return played;
+}
+
+//a keyframe gives the region and then every row of it, written like TTLRLE rows
+bool replay_keyframe(Replay* r){
+    long long x;
+    long long y;
+    int width;
+    int height;
+    if ((sscanf(r->line, "K %lld %lld %d %d", &x, &y, &width, &height) != 4) || (width < 0) || (height < 0)){
+        return false;
+    }
+
+    char* cells = calloc((size_t)width * height + 1, 1);
+    if (cells == NULL){
+        return false;
+    }
+    free(r->cells);
+    r->cells = cells;
+    r->x = x;
+    r->y = y;
+    r->width = width;
+    r->height = height;
+
+    int row = 0;
+    while (row < height){
+        if (!read_line(r)){
+            return false;
+        }
+
+        long long repeats = 1; //a row of runs is used once
+        char* here = r->cells + (size_t)row * width;
+        if (r->line[0] == '+'){
+            char* end;
+            repeats = strtoll(r->line + 1, &end, 10);
+            if ((*end != '\0') || (repeats < 1) || (repeats > height - row)){
+                return false;
+            }
+            if (row > 0){
+                memcpy(here, here - width, width); //copies of the row before, which starts out empty
+            }
+            for (long long n = 1; n < repeats; n++){
+                memcpy(here + n * width, here, width);
+            }
+        }
+        else if (rle_decode(r->line, here, width, '\0', true) < 0){
+            return false;
+        }
+        row += repeats;
+    }
+
+    if (r->screen){
+        neillclrscrn();
+        for (row = 0; row < height; row++){
+            draw_cells(r->cells + (size_t)row * width, row, 0, width);
+        }
+    }
+    return true;
+}
+
+//a delta frame is a line per changed span, "row column runs"
+bool replay_delta(Replay* r){
+    while (read_line(r)){
+        if ((r->line[0] == 'K') || (r->line[0] == 'F')){
+            r->pending = true; //the start of the next frame
+            return true;
+        }
+
+        int row;
+        int col;
+        int skip;
+        if ((sscanf(r->line, "%d %d %n", &row, &col, &skip) != 2) || (row < 0) || (row >= r->height) || (col < 0) || (col >= r->width)){
+            return false;
+        }
+        char* here = r->cells + (size_t)row * r->width + col;
+        int n = rle_decode(r->line + skip, here, r->width - col, '\0', false);
+        if (n < 0){
+            return false;
+        }
+
+        if (r->screen){
+            draw_cells(here, row, col, n);
+        }
+    }
+    return !ferror(r->in);
+}
+
+//read the next line without its newline, returns false at the end of the log
+bool read_line(Replay* r){
+    ssize_t length = getline(&r->line, &r->capacity, r->in);
+    if (length <= 0){
+        return false;
+    }
+    if (r->line[length - 1] == '\n'){
+        r->line[length - 1] = '\0';
+    }
+    return true;
+}
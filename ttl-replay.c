@@ -0,0 +1,84 @@
+#include "turtle-graphics.h"
+#include "../neillsimplescreen.h"
+
+//plays back a frame log written by turtle-graphics --record, on the terminal at any speed or
+//straight into a text grid
+
+#define DEFAULT_REPLAY_FPS 60
+
+int main(int argc, char** argv){
+    double fps = DEFAULT_REPLAY_FPS;
+    long long frame = -1; //-1 plays the whole log
+    int i = 1;
+
+    while ((i < argc) && (strncmp(argv[i], "--", 2) == 0)){
+        if (samestr(argv[i], "--fps") && (i + 1 < argc)){
+            i++;
+            fps = strtod(argv[i], NULL); //0 plays as fast as the terminal can take it
+            if (fps < 0){
+                fprintf(stderr, "invalid frame rate %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--frame") && (i + 1 < argc)){
+            i++;
+            frame = atoll(argv[i]); //stop after this frame and write the grid out
+            if (frame < 1){
+                fprintf(stderr, "invalid frame %s, frames count from 1\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        i++;
+    }
+
+    int files = argc - i;
+    if ((files < 1) || (files > 2) || ((frame > 0) != (files == 2))){
+        fprintf(stderr, "invalid number of arguments.\nUsage: ./ttl-replay [--fps N] <logfile>\n       ./ttl-replay --frame N <logfile> <outputfile>");
+        exit(EXIT_FAILURE);
+    }
+
+    Replay r;
+    FILE* in = fopen(argv[i], "r");
+    if ((in == NULL) || !replay_open(&r, in)){
+        fprintf(stderr, "failed to open frame log!");
+        exit(EXIT_FAILURE);
+    }
+    r.screen = (files == 1);
+
+    bool done = false;
+    while (!done && ((frame < 0) || (r.frames < frame))){
+        if (!replay_next(&r, &done)){
+            fprintf(stderr, "invalid frame log after frame %lld!", r.frames);
+            exit(EXIT_FAILURE);
+        }
+
+        if (r.screen && !done && (fps > 0)){
+            struct timespec wait;
+            wait.tv_sec = (time_t)(1.0 / fps);
+            wait.tv_nsec = (long)((1.0 / fps - wait.tv_sec) * 1e9);
+            while (nanosleep(&wait, &wait) != 0){ //keep sleeping if a signal cut the wait short
+            }
+        }
+    }
+    fclose(in);
+
+    if (r.screen){
+        neillreset(); //leave the terminal in its normal colours
+        printf("\033[%d;1H\n", r.height + 1);
+    }
+    else {
+        FILE* wp = fopen(argv[i + 1], "w");
+        if ((wp == NULL) || !write_cells(wp, r.cells, r.width, r.height) || (fclose(wp) != 0)){
+            fprintf(stderr, "failed to write to output file!");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(r.cells);
+    free(r.line);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,248 @@
+#include "turtle-graphics.h"
+#include "../neillsimplescreen.h"
+
+//watches a render published by turtle-graphics --publish, on the terminal or by writing the latest
+//frame out as text. any number of viewers can watch at once, the writer never waits for them
+
+#define DEFAULT_VIEWER_FPS 30
+#define SNAPSHOT_TRIES 100 //times to try for a whole frame before waiting for the next one
+
+typedef struct Viewer {
+    const char* name; //shared memory object the writer publishes to
+    const ShmHeader* header; //the writer's ring, mapped read only, NULL while there isn't one
+    size_t size;
+    int width;
+    int height;
+    char* cells; //the last whole frame copied out of the ring
+    char* shown; //what is on the terminal, to only draw what changed
+    uint64_t frame; //frame in cells, 0 for none yet
+} Viewer;
+
+bool viewer_wait(Viewer* v, double fps, double timeout);
+bool viewer_open(Viewer* v);
+void viewer_close(Viewer* v);
+bool viewer_snapshot(Viewer* v);
+void viewer_draw(Viewer* v, bool all);
+void wait_seconds(double seconds);
+
+int main(int argc, char** argv){
+    double fps = DEFAULT_VIEWER_FPS;
+    double timeout = 0; //wait for the writer for ever
+    bool once = false;
+    int i = 1;
+
+    while ((i < argc) && (strncmp(argv[i], "--", 2) == 0)){
+        if (samestr(argv[i], "--fps") && (i + 1 < argc)){
+            i++;
+            fps = strtod(argv[i], NULL); //how often to look for a new frame
+            if (fps <= 0){
+                fprintf(stderr, "invalid frame rate %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--timeout") && (i + 1 < argc)){
+            i++;
+            timeout = strtod(argv[i], NULL); //most seconds to wait for the writer to make the ring
+            if (timeout < 0){
+                fprintf(stderr, "invalid timeout %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--once")){
+            once = true; //write the latest frame out and stop
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        i++;
+    }
+
+    int files = argc - i;
+    if (files != (once ? 2 : 1)){
+        fprintf(stderr, "invalid number of arguments.\nUsage: ./ttl-viewer [--fps N] [--timeout SECONDS] </name>\n       ./ttl-viewer --once [--timeout SECONDS] </name> <outputfile>");
+        exit(EXIT_FAILURE);
+    }
+
+    Viewer v;
+    memset(&v, 0, sizeof(Viewer));
+    v.name = argv[i];
+    if (!viewer_wait(&v, fps, timeout)){
+        fprintf(stderr, "failed to open shared memory %s!", argv[i]);
+        exit(EXIT_FAILURE);
+    }
+
+    bool finished = false;
+    while (!finished){
+        finished = atomic_load_explicit(&v.header->finished, memory_order_acquire); //before the snapshot, so the last frame is never missed
+        if (!finished && atomic_load_explicit(&v.header->closed, memory_order_acquire)){
+            viewer_close(&v); //the region changed and the writer made a new ring, follow it
+            if (!viewer_wait(&v, fps, timeout)){
+                fprintf(stderr, "failed to open shared memory %s!", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        bool first = (v.frame == 0); //the terminal still has whatever was on it before
+        bool changed = viewer_snapshot(&v);
+
+        if (once){
+            if (v.frame > 0){
+                break;
+            }
+        }
+        else if (changed){
+            viewer_draw(&v, first);
+        }
+        if (!finished){
+            wait_seconds(1.0 / fps);
+        }
+    }
+
+    if (once){
+        FILE* wp = fopen(argv[i + 1], "w");
+        if ((wp == NULL) || !write_cells(wp, v.cells, v.width, v.height) || (fclose(wp) != 0)){
+            fprintf(stderr, "failed to write to output file!");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        neillreset(); //leave the terminal in its normal colours
+        printf("\033[%d;1H\n", v.height + 1);
+    }
+
+    viewer_close(&v);
+    free(v.cells);
+    free(v.shown);
+    return EXIT_SUCCESS;
+}
+
+//keep trying to open the ring fps times a second until the writer has made it, or timeout seconds
+//have gone by if timeout isn't 0
+bool viewer_wait(Viewer* v, double fps, double timeout){
+    for (double waited = 0; !viewer_open(v); waited += 1.0 / fps){
+        if ((timeout > 0) && (waited >= timeout)){
+            return false;
+        }
+        wait_seconds(1.0 / fps);
+    }
+    return true;
+}
+
+//map the ring read only, fails if the writer hasn't finished making it. a ring of another size
+//than the last one gets new cells, and every new ring is drawn from scratch
+bool viewer_open(Viewer* v){
+    int fd = shm_open(v->name, O_RDONLY, 0);
+    if (fd < 0){
+        return false;
+    }
+
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || ((size_t)info.st_size < sizeof(ShmHeader))){
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        return false;
+    }
+
+    const ShmHeader* h = map;
+    if ((atomic_load_explicit(&h->magic, memory_order_acquire) != SHM_MAGIC) || (h->version != SHM_VERSION) || (h->slots == 0)
+        || (h->header_size + h->slot_size * h->slots > (size_t)info.st_size) || (sizeof(ShmSlot) + (size_t)h->width * h->height > h->slot_size)){
+        munmap(map, info.st_size);
+        return false;
+    }
+
+    if ((v->cells == NULL) || (h->width != v->width) || (h->height != v->height)){
+        char* cells = calloc((size_t)h->width * h->height + 1, 1);
+        char* shown = calloc((size_t)h->width * h->height + 1, 1);
+        if ((cells == NULL) || (shown == NULL)){
+            free(cells);
+            free(shown);
+            munmap(map, info.st_size);
+            return false;
+        }
+        free(v->cells);
+        free(v->shown);
+        v->cells = cells;
+        v->shown = shown;
+        v->width = h->width;
+        v->height = h->height;
+    }
+    v->header = h;
+    v->size = info.st_size;
+    v->frame = 0; //frames count from 1 again in every ring
+    return true;
+}
+
+void viewer_close(Viewer* v){
+    if (v->header != NULL){
+        munmap((void*)v->header, v->size);
+        v->header = NULL;
+    }
+}
+
+//copy the newest frame out of the ring if it is newer than the one we have. the slot's sequence is
+//read before and after copying, if it was odd or moved the writer was in the slot, so try again
+//with whatever is newest then. returns whether cells changed
+bool viewer_snapshot(Viewer* v){
+    const ShmHeader* h = v->header;
+    size_t cells = (size_t)v->width * v->height;
+
+    for (int tries = 0; tries < SNAPSHOT_TRIES; tries++){
+        uint64_t latest = atomic_load_explicit(&h->latest, memory_order_acquire);
+        if (latest <= v->frame){
+            return false; //nothing new
+        }
+
+        const ShmSlot* slot = (const ShmSlot*)((const char*)h + h->header_size + (latest % h->slots) * h->slot_size);
+        uint64_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (before % 2 != 0){
+            continue;
+        }
+        memcpy(v->cells, slot->cells, cells);
+        uint64_t frame = slot->frame;
+        atomic_thread_fence(memory_order_acquire);
+        if ((atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before) && (frame == latest)){
+            v->frame = frame;
+            return true;
+        }
+    }
+    return false; //the writer kept lapping us, the next poll will catch up
+}
+
+//draw the spans of each row that differ from what is on the terminal
+void viewer_draw(Viewer* v, bool all){
+    if (all){
+        neillclrscrn();
+    }
+    for (int row = 0; row < v->height; row++){
+        const char* cells = v->cells + (size_t)row * v->width;
+        char* shown = v->shown + (size_t)row * v->width;
+        int first = 0;
+        int last = v->width - 1;
+        if (!all){
+            while ((first < v->width) && (cells[first] == shown[first])){
+                first++;
+            }
+            while ((last >= first) && (cells[last] == shown[last])){
+                last--;
+            }
+        }
+        if (first <= last){
+            draw_cells(cells + first, row, first, last - first + 1);
+            memcpy(shown + first, cells + first, last - first + 1);
+        }
+    }
+    fflush(stdout);
+}
+
+void wait_seconds(double seconds){
+    struct timespec wait;
+    wait.tv_sec = (time_t)seconds;
+    wait.tv_nsec = (long)((seconds - wait.tv_sec) * 1e9);
+    while (nanosleep(&wait, &wait) != 0){ //keep sleeping if a signal cut the wait short
+    }
+}
@@ -1,987 +1,4511 @@
 #include "turtle-graphics.h"
 #include "../neillsimplescreen.h"
 
+neillcol find_neillcol(char col);
+
+//cos and sin of every whole degree from -TRIG_RANGE to TRIG_RANGE, made with the same formula
+//calc_position used to use so the positions don't change. filled once and only read after that
+static double trig_cos[2 * TRIG_RANGE + 1];
+static double trig_sin[2 * TRIG_RANGE + 1];
+static pthread_once_t trig_once = PTHREAD_ONCE_INIT;
+
+//--packed cells are 4 bit codes, 0 is empty and 1 to 8 are the colours
+static const char packed_colours[PACKED_CODES] = {'\0', 'K', 'R', 'G', 'B', 'Y', 'C', 'M', 'W'};
+static const unsigned char packed_codes[256] = {['K'] = 1, ['R'] = 2, ['G'] = 3, ['B'] = 4, ['Y'] = 5, ['C'] = 6, ['M'] = 7, ['W'] = 8};
+
+//red, green, blue and alpha of each packed code for --format ppm and pam. empty cells are clear in
+//pam and black in ppm, like the terminal background
+static const unsigned char palette[PACKED_CODES][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, 255}, {205, 0, 0, 255}, {0, 205, 0, 255}, {0, 0, 238, 255},
+    {205, 205, 0, 255}, {0, 205, 205, 255}, {205, 0, 205, 255}, {229, 229, 229, 255}
+};
+
+//both cells of every packed byte already turned back into colours, so a row unpacks two cells per
+//lookup. filled once and only read after that
+static char packed_pairs[256][2];
+static pthread_once_t packed_once = PTHREAD_ONCE_INIT;
+
+//signal that asked a --publish run to stop. the handler only sets it, publish_due stops the run and
+//main takes the ring away, since none of that is safe inside a handler
+static volatile sig_atomic_t stop_signal;
+
+//atan(2^-i) in 1/65536ths of a degree, the steps fixed_heading rotates by
+static const long long cordic_atan[CORDIC_STEPS] = {
+    2949120, 1740967, 919879, 466945, 234379, 117304, 58666, 29335, 14668, 7334, 3667, 1833,
+    917, 458, 229, 115, 57, 29, 14, 7, 4, 2, 1
+};
+
 int main(int argc, char **argv){
-    test();
+    TTLOptions options;
+    TTLError error;
+    Batch batch;
+    Server server;
+
+    ttl_default_options(&options);
+    memset(&batch, 0, sizeof(Batch));
+    memset(&server, 0, sizeof(Server));
+    server.capacity = DEFAULT_QUEUE_SIZE;
+    int first = parse_options(&options, &batch, &server, argc, argv);
+    argc -= first - 1;
+    argv += first - 1; //drop the options so the file names are back at READFILE and WRITEFILE
+
+    if (options.rle_to_text){
+        if (argc != 3){
+            fprintf(stderr, "invalid number of arguments.\nUsage: ./filename --rle-to-text <rlefile> <outputfile>");
+            exit(EXIT_FAILURE);
+        }
+        FILE* in = fopen(argv[READFILE], "r");
+        FILE* out = fopen(argv[WRITEFILE], "w");
+        if ((in == NULL) || (out == NULL)){
+            fprintf(stderr, "failed to locate file!");
+            exit(EXIT_FAILURE);
+        }
+        bool converted = rle_to_text(in, out);
+        fclose(in);
+        if ((fclose(out) != 0) || !converted){
+            exit(EXIT_FAILURE);
+        }
+        return EXIT_SUCCESS;
+    }
 
-    Parser* c = calloc(1, sizeof(Parser));
-    c->args = argc;
-    turtle_init(c);
-    stack_init(c);
+    if (server.serve){
+        return run_server(&server, &options, batch.nworkers);
+    }
+
+    if (server.connect){
+        if ((argc < 2) || (argc > 3)){
+            fprintf(stderr, "invalid number of arguments.\nUsage: ./filename --connect <socket> [options] <TTLfile> <outputfile>");
+            exit(EXIT_FAILURE);
+        }
+        return run_client(&server, &options, argc - 1, argv + 1, batch.enabled);
+    }
+
+    if (batch.enabled){
+        if (argc != 3){
+            fprintf(stderr, "invalid number of arguments.\nUsage: ./filename --batch [options] <manifest or directory> <outputdirectory>");
+            exit(EXIT_FAILURE);
+        }
+        return run_batch(&batch, &options, argv[READFILE], argv[WRITEFILE]);
+    }
+    options.screen = (argc == 2) && (options.record_path == NULL) && (options.publish == NULL); //no output file, so draw on the terminal as the program runs
+    if (options.record_path != NULL){
+        options.record = ttl_record_open(options.record_path); //every line drawn goes into a frame log instead
+        if (options.record == NULL){
+            fprintf(stderr, "failed to open frame log %s!", options.record_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    options.ask = ask; //missing values are typed in at the terminal
 
-    FILE* fp = fopen(argv[READFILE], "r");
-    FILE* wp = fopen(argv[WRITEFILE], "w");
+    Parser* c = ttl_engine_create(&options);
+    FILE* fp = (argc > READFILE) ? fopen(argv[READFILE], "r") : NULL;
+    FILE* wp = (argc > WRITEFILE) ? fopen(argv[WRITEFILE], "w") : NULL;
     on_error(c, fp, wp, argc); //check for any issues with allocating memory or locating files
-    load_ins(c, fp); //copy instructions from TTL file into a 2d array
-    fclose(fp);
 
-    if (!prog(c)){
-        fprintf(stderr, "Invalid grammar, failed to parse!");
+    if (options.publish != NULL){
+        struct sigaction stop;
+        memset(&stop, 0, sizeof(stop));
+        stop.sa_handler = stop_publishing; //no SA_RESTART, so a wait for a missing value is cut short too
+        sigemptyset(&stop.sa_mask);
+        sigaction(SIGINT, &stop, NULL);
+        sigaction(SIGTERM, &stop, NULL);
+    }
+
+    if (ttl_engine_run_file(c, fp, &error) != TTL_OK){
+        fprintf(stderr, "%s", error.message);
+        ttl_engine_destroy(c); //takes the --publish ring away too
+        stopped();
         exit(EXIT_FAILURE);
     }
+    fclose(fp);
+
+    if (options.stats){
+        print_stats(c);
+    }
+
+    if (options.raster_bench && !options.screen){
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        int most = (options.raster_threads > 0) ? options.raster_threads : (cores < 1) ? 1 : (cores > MAX_BATCH_WORKERS) ? MAX_BATCH_WORKERS : (int)cores;
+        raster_bench(c, most);
+    }
 
     if (argc == 3){
-        print_grid(c, wp);
+        if (ttl_engine_write(c, wp, &error) != TTL_OK){
+            fprintf(stderr, "%s", error.message);
+            ttl_engine_destroy(c);
+            exit(EXIT_FAILURE);
+        }
+        fclose(wp);
     }
 
-    else {
-        print_screen(c);
+    else if (options.screen){
+        screen_present(c); //show whatever is still waiting for a frame
+        screen_close(c);
     }
 
-    parser_free(c);
+    if ((options.record != NULL) && (fclose(options.record) != 0)){
+        fprintf(stderr, "failed to write to the frame log!");
+        ttl_engine_destroy(c);
+        exit(EXIT_FAILURE);
+    }
+    ttl_engine_destroy(c);
+    stopped();
 }
 
-void load_ins(Parser* c, FILE* fp){
-    int i = 0;
+//ctrl-c or kill while publishing, only note it, see stop_signal
+void stop_publishing(int sig){
+    stop_signal = sig;
+}
+
+//once the ring is gone, die of the signal that stopped the run so the parent sees how it ended
+void stopped(void){
+    if (stop_signal != 0){
+        signal(stop_signal, SIG_DFL);
+        raise(stop_signal);
+    }
+}
 
-    while (fscanf(fp, "%s", c->instruction[i]) != EOF){ //copy all instructions in TTL file to parser
+//read the --options in front of the file names, returns the index of the first file name
+int parse_options(TTLOptions* o, Batch* b, Server* sv, int argc, char** argv){
+    int i = 1;
+
+    while ((i < argc) && (strncmp(argv[i], "--", 2) == 0)){
+        if ((samestr(argv[i], "--serve") || samestr(argv[i], "--connect")) && (i + 1 < argc)){
+            sv->serve = samestr(argv[i], "--serve"); //render programs sent over a unix socket
+            sv->connect = !sv->serve; //send programs to a running server instead of drawing them here
+            i++;
+            sv->path = argv[i];
+            i++;
+            continue;
+        }
+        if (samestr(argv[i], "--queue") && (i + 1 < argc)){
+            i++;
+            sv->capacity = atoi(argv[i]); //most jobs waiting for a worker before readers have to wait
+            if (sv->capacity < 1){
+                fprintf(stderr, "invalid queue size %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            i++;
+            continue;
+        }
+        if (samestr(argv[i], "--test")){
+            test(); //run the tests instead of a program
+            exit(EXIT_SUCCESS);
+        }
+        else if (samestr(argv[i], "--batch")){
+            b->enabled = true; //run a whole list of files on a pool of threads
+        }
+        else if (samestr(argv[i], "--jobs") && (i + 1 < argc)){
+            i++;
+            b->nworkers = atoi(argv[i]); //number of worker threads in batch mode
+            if ((b->nworkers < 1) || (b->nworkers > MAX_BATCH_WORKERS)){
+                fprintf(stderr, "invalid number of jobs %s, use 1 to %d\n", argv[i], MAX_BATCH_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--stats")){
+            o->stats = true; //report how fast the program was parsed and run
+        }
+        else if (samestr(argv[i], "--fixed")){
+            o->fixed = true; //keep the turtle in fixed point so results are the same on every machine
+        }
+        else if (samestr(argv[i], "--display-list")){
+            o->display_list = true; //record the lines and draw them all once the program has finished
+        }
+        else if (samestr(argv[i], "--raster-threads") && (i + 1 < argc)){
+            i++;
+            o->raster_threads = atoi(argv[i]); //draw the display list on this many threads
+            o->display_list = true;
+            if ((o->raster_threads < 1) || (o->raster_threads > MAX_BATCH_WORKERS)){
+                fprintf(stderr, "invalid number of raster threads %s, use 1 to %d\n", argv[i], MAX_BATCH_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--raster-bench")){
+            o->raster_bench = true; //time drawing the display list on more and more threads
+            o->display_list = true;
+        }
+        else if (samestr(argv[i], "--legacy-raster")){
+            o->legacy_raster = true; //draw lines exactly like the original floating point version
+        }
+        else if (samestr(argv[i], "--fps") && (i + 1 < argc)){
+            i++;
+            o->fps = strtod(argv[i], NULL); //most frames drawn to the terminal per second
+            if (o->fps <= 0){
+                fprintf(stderr, "invalid frame rate %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--delay") && (i + 1 < argc)){
+            i++;
+            o->delay = strtod(argv[i], NULL); //seconds to pause after every line on the terminal
+            if (o->delay < 0){
+                fprintf(stderr, "invalid delay %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--mmap-output")){
+            o->mmap_output = true; //write the output file through a shared mapping
+        }
+        else if (samestr(argv[i], "--format") && (i + 1 < argc)){
+            i++;
+            if (samestr(argv[i], "text")){
+                o->format = TTL_FORMAT_TEXT;
+            }
+            else if (samestr(argv[i], "rle")){
+                o->format = TTL_FORMAT_RLE; //rows as runs of colours, much smaller for mostly empty grids
+            }
+            else if (samestr(argv[i], "ppm")){
+                o->format = TTL_FORMAT_PPM; //binary images
+            }
+            else if (samestr(argv[i], "pam")){
+                o->format = TTL_FORMAT_PAM;
+            }
+            else {
+                fprintf(stderr, "invalid format %s, use text, rle, ppm or pam\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--scale") && (i + 1 < argc)){
+            i++;
+            o->scale = atoi(argv[i]); //ppm and pam only: pixels across each cell
+            if ((o->scale < 1) || (o->scale > MAX_IMAGE_SCALE)){
+                fprintf(stderr, "invalid scale %s, use 1 to %d\n", argv[i], MAX_IMAGE_SCALE);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--record") && (i + 1 < argc)){
+            i++;
+            o->record_path = argv[i]; //write a frame log of every line drawn, for ttl-replay
+        }
+        else if (samestr(argv[i], "--publish") && (i + 1 < argc)){
+            i++;
+            o->publish = argv[i]; //share frames with ttl-viewer through shared memory
+            if ((argv[i][0] != '/') || (strlen(argv[i]) >= SHM_NAME_SIZE) || (strchr(argv[i] + 1, '/') != NULL)){
+                fprintf(stderr, "invalid shared memory name %s, use /name\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--rle-to-text")){
+            o->rle_to_text = true; //turn an rle output file back into the text grid
+        }
+        else if (samestr(argv[i], "--packed")){
+            o->packed = true; //half the memory, two cells to a byte
+        }
+        else if (samestr(argv[i], "--sparse")){
+            o->sparse = true; //unbounded canvas made of tiles that appear as they are drawn on
+        }
+        else if (samestr(argv[i], "--viewport") && (i + 1 < argc)){
+            i++;
+            o->viewport = true;
+            if ((sscanf(argv[i], "%lld,%lld,%dx%d", &o->view_x, &o->view_y, &o->view_width, &o->view_height) != 4) ||
+                (o->view_width < 1) || (o->view_width > MAX_CANVAS_SIZE) || (o->view_height < 1) || (o->view_height > MAX_CANVAS_SIZE)){
+                fprintf(stderr, "invalid viewport %s, use X,Y,WIDTHxHEIGHT\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (samestr(argv[i], "--size") && (i + 1 < argc)){
+            i++;
+            if ((sscanf(argv[i], "%dx%d", &o->width, &o->height) != 2) ||
+                (o->width < 1) || (o->width > MAX_CANVAS_SIZE) || (o->height < 1) || (o->height > MAX_CANVAS_SIZE)){
+                fprintf(stderr, "invalid canvas size %s, use WIDTHxHEIGHT up to %dx%d\n", argv[i], MAX_CANVAS_SIZE, MAX_CANVAS_SIZE);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
         i++;
     }
+    return i;
+}
 
-    c->instruction[i][0] = '\0';
+void print_stats(TTLEngine* c){
+    TTLStats stats;
+    ttl_engine_stats(c, &stats);
+
+    double rate = (stats.parse_seconds > 0) ? stats.tokens / stats.parse_seconds : 0;
+    fprintf(stderr, "%d tokens, %d instructions, parsed in %.6f s (%.0f tokens/s), ran in %.6f s\n",
+            stats.tokens, stats.instructions, stats.parse_seconds, rate, stats.run_seconds);
+    if (c->options.display_list){
+        fprintf(stderr, "%lld segments drawn from the display list\n", stats.segments);
+    }
 }
 
-void stack_init(Parser* c){
-    c->stack = calloc(1, sizeof(Stack));
-    if (c->stack == NULL){
-        fprintf(stderr, "failed to allocate stack memory!");
-        exit(EXIT_FAILURE);
+void ttl_default_options(TTLOptions* o){
+    memset(o, 0, sizeof(TTLOptions));
+    o->width = DEFAULT_WIDTH;
+    o->height = DEFAULT_HEIGHT;
+    o->fps = DEFAULT_FPS;
+    o->delay = WAIT_TIME;
+}
+
+//change the options of an existing engine, the canvas is only made again if its size or kind changed.
+//if the new canvas can't be made the engine keeps its old options
+TTLStatus ttl_engine_set_options(TTLEngine* c, const TTLOptions* options){
+    Canvas* g = &c->turtle->grid;
+
+    if ((options->width != c->options.width) || (options->height != c->options.height) || (options->sparse != c->options.sparse) ||
+        (options->packed != c->options.packed)){
+        Canvas grid;
+        memset(&grid, 0, sizeof(Canvas));
+        bool made = options->sparse ? sparse_init(&grid, options->width, options->height) : canvas_init(&grid, options->width, options->height, options->packed);
+        if (!made){
+            canvas_free(&grid);
+            return TTL_ERR_MEMORY;
+        }
+        canvas_free(g);
+        *g = grid;
     }
-    c->stack->top = EMPTY_STACK; //initialise stack pointer to signal an empty stack
+
+    c->options = *options;
+    return TTL_OK;
 }
 
-void turtle_init(Parser* c){
-    c->turtle = calloc(1, sizeof(Turtle)); 
-    if (c->turtle == NULL){
-        fprintf(stderr, "failed to allocate turtle memory!");
-        exit(EXIT_FAILURE);
+//make an engine that can run any number of programs one after another, returns NULL if out of memory
+TTLEngine* ttl_engine_create(const TTLOptions* options){
+    Parser* c = calloc(1, sizeof(Parser));
+    if (c == NULL){
+        return NULL;
     }
-    c->turtle->y = (MAXHEIGHT/2);
-    c->turtle->x = (MAXWIDTH/2); //set starting positions
-    c->turtle->oldY = 0;
-    c->turtle->oldX = 0;
-    c->turtle->angle = FWDANGLE; //set starting angle
-    c->turtle->colour = 'W'; //set starting colour
 
-    for (int y = 0; y < MAXHEIGHT; y++){
-        for (int x = 0; x < MAXWIDTH; x++){
-            c->turtle->grid[y][x] = '\0'; //populate the turtle grid with null characters
-        }
+    c->options = *options;
+    if (!stack_init(c) || !turtle_init(c)){
+        parser_free(c);
+        return NULL;
     }
+    return c;
 }
 
-void on_error(Parser* c, FILE* fp, FILE* wp, int argc){
+//compile and run a TTL program held in memory, the source only has to stay alive until this returns
+TTLStatus ttl_engine_run(TTLEngine* c, const char* source, size_t size, TTLError* error){
+    engine_reset(c);
+    c->source = source;
+    c->source_size = size;
+    return engine_finish(c, error);
+}
 
-    if ((argc <= 1) || (argc > 3)){
-        fprintf(stderr, "invalid number of arguments.\nUsage: ./filename <TTLfile> <outputfile>");
-        exit(EXIT_FAILURE);
+TTLStatus ttl_engine_run_file(TTLEngine* c, FILE* fp, TTLError* error){
+    engine_reset(c);
+    if (load_ins(c, fp)){ //map the TTL file
+        return engine_finish(c, error);
+    }
+    if (error != NULL){
+        *error = c->error;
     }
+    return c->error.status;
+}
 
-    if (c == NULL){
-        fprintf(stderr, "failed to allocate memory!");
-        exit(EXIT_FAILURE);
+//write the grid left by the last program run
+TTLStatus ttl_engine_write(TTLEngine* c, FILE* wp, TTLError* error){
+    c->cw = -1; //not inside the program any more
+    print_grid(c, wp);
+    if (error != NULL){
+        *error = c->error;
     }
+    return c->error.status;
+}
 
-    if (fp == NULL){
-        fprintf(stderr, "failed to locate file!");
-        exit(EXIT_FAILURE);
+//draw the display list of the last program run again with new options, so the same drawing can be
+//made at another size or on another kind of canvas without running the program again. the drawing
+//stays around the start of the new canvas. the options must have display_list set
+TTLStatus ttl_engine_redraw(TTLEngine* c, const TTLOptions* options, TTLError* error){
+    c->cw = -1; //not inside the program any more
+    memset(&c->error, 0, sizeof(TTLError));
+
+    if (!options->display_list){
+        fail(c, TTL_ERR_IO, "nothing to redraw without a display list!");
+    }
+    else if (ttl_engine_set_options(c, options) != TTL_OK){
+        fail(c, TTL_ERR_MEMORY, "failed to allocate memory!");
+    }
+    else {
+        canvas_clear(&c->turtle->grid);
+        display_render(c);
     }
 
-    if (argc == 3){
-        if (wp == NULL){ //if file to write to is unable to be found even though there are 3 arguments exit code 1
-            fprintf(stderr, "failed to locate file to write to!");
-            exit(EXIT_FAILURE);
-        }
+    if (error != NULL){
+        *error = c->error;
     }
+    return c->error.status;
 }
 
-void parser_free(Parser* c){ //free all dynamically allocated memory
-    free(c->stack);
-    free(c->turtle);
-    free(c);
+//sizes and timings of the last program run
+void ttl_engine_stats(TTLEngine* c, TTLStats* stats){
+    *stats = c->stats;
 }
 
-bool prog(Parser* c){
+double elapsed(struct timespec start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
 
-    if (samestr(c->instruction[c->cw], "START")){ //check that each file begins with a START command
-        c->cw = c->cw + 1;
-        if (inslst(c)){ 
-            return true;
-        }
+Canvas* ttl_engine_canvas(TTLEngine* c){
+    return &c->turtle->grid;
+}
+
+void ttl_engine_destroy(TTLEngine* c){
+    if (c != NULL){
+        publish_close(c, true);
+        parser_free(c);
     }
-    return false;
 }
 
-bool inslst(Parser* c){
+const char* ttl_status_string(TTLStatus status){
+    switch (status){
+        case TTL_OK:
+            return "ok";
+        case TTL_ERR_MEMORY:
+            return "out of memory";
+        case TTL_ERR_IO:
+            return "input or output failed";
+        case TTL_ERR_GRAMMAR:
+            return "invalid grammar";
+        case TTL_ERR_LOOP_ITEMS:
+            return "invalid loop items";
+        case TTL_ERR_POSTFIX:
+            return "invalid postfix items";
+        case TTL_ERR_VARIABLE:
+            return "invalid variable";
+        case TTL_ERR_STACK_OVERFLOW:
+            return "stack overflow";
+        case TTL_ERR_STACK_UNDERFLOW:
+            return "stack underflow";
+        case TTL_ERR_DIVIDE_BY_ZERO:
+            return "division by zero";
+        case TTL_ERR_INPUT:
+            return "no valid answer for a missing value";
+        case TTL_ERR_INTERRUPTED:
+            return "interrupted";
+    }
+    return "unknown error";
+}
 
-    if (samestr(c->instruction[c->cw], "END")){
-        return true;
+//put everything back the way ttl_engine_create left it, keeping the memory that can be reused
+void engine_reset(Parser* c){
+    free_source(c);
+    c->ntokens = 0;
+    c->program.size = 0;
+    c->program.nitems = 0;
+    c->cw = 0;
+    memset(c->variable, 0, sizeof(c->variable));
+    memset(&c->error, 0, sizeof(TTLError));
+    c->stack->top = EMPTY_STACK;
+    c->display.size = 0;
+    c->watched = c->options.screen || (c->options.record != NULL) || (c->options.publish != NULL);
+    c->screen.started = false;
+    c->screen.out_of_memory = false;
+    c->screen.fps = c->options.fps;
+    c->screen.delay = c->options.delay;
+    turtle_reset(c);
+    if (c->options.record != NULL){
+        record_frame(c); //the empty grid is the first keyframe, so a run that draws nothing still has one
     }
+}
 
-    if (ins(c)){ //not the end - must be an instruction
-        c->cw = c->cw + 1; //next letter
-        return inslst(c);//recursion until END reached
+//lex, compile and run whatever source the engine has been given
+TTLStatus engine_finish(Parser* c, TTLError* error){
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&c->stats, 0, sizeof(TTLStats));
+
+    if (lex(c)){
+        bool parsed = prog(c); //compile the whole program before running any of it
+        c->stats.tokens = c->ntokens;
+        c->stats.instructions = c->program.size;
+        c->stats.parse_seconds = elapsed(start);
+
+        if (parsed){
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            run(c);
+            if (c->options.display_list && !c->watched){
+                display_render(c); //everything the program drew before any error, same as drawing straight away
+            }
+            if (c->options.publish != NULL){
+                publish_frame(c, true); //viewers always get the finished grid
+            }
+            c->stats.run_seconds = elapsed(start);
+        }
+        else {
+            fail(c, TTL_ERR_GRAMMAR, "Invalid grammar, failed to parse!");
+        }
+    }
+    free_source(c); //the compiled program no longer needs the text
+
+    if (error != NULL){
+        *error = c->error;
+    }
+    return c->error.status;
+}
+
+//record the first error, where it happened, and return false so callers can pass it straight back
+bool fail(Parser* c, TTLStatus status, const char* message){
+    if (c->error.status != TTL_OK){
+        return false; //the first error is the one that matters
+    }
+
+    c->error.status = status;
+    c->error.token = -1;
+    c->error.line = 0;
+    snprintf(c->error.message, sizeof(c->error.message), "%s", message);
+
+    if ((c->cw >= 0) && (c->cw < c->ntokens)){ //point at the token being worked on
+        c->error.token = c->cw;
+        c->error.line = 1;
+        for (size_t i = 0; (i < c->tokens[c->cw].offset) && (i < c->source_size); i++){
+            if (c->source[i] == '\n'){
+                c->error.line++;
+            }
+        }
     }
     return false;
 }
 
-bool ins(Parser* c){
-    //check through the list of instructions until a match is found
-    if (fwd(c)){
-        return true;
+void free_source(Parser* c){
+    if (c->mapped){
+        munmap((void*)c->source, c->source_size);
     }
+    else if (c->owned){
+        free((void*)c->source);
+    }
+    c->source = NULL;
+    c->source_size = 0;
+    c->mapped = false;
+    c->owned = false;
+}
 
-    if (rgt(c)){
-        return true;
+//render every file in a manifest (one path per line) or a directory of .ttl files into outdir,
+//the files are shared out between worker threads that steal from each other when they run dry.
+//returns the exit code, which is a failure if any file failed
+int run_batch(Batch* b, const TTLOptions* options, const char* list, const char* outdir){
+    struct stat st;
+    bool loaded;
+
+    b->options = *options;
+    b->options.screen = false; //the terminal can't be shared between threads
+    b->options.ask = NULL; //and nobody is there to answer, so missing values are errors
+    b->options.record = NULL; //nor can a frame log
+    b->options.publish = NULL; //or a frame ring
+    b->outdir = outdir;
+
+    if (stat(list, &st) != 0){
+        fprintf(stderr, "failed to locate file!");
+        return EXIT_FAILURE;
+    }
+    loaded = S_ISDIR(st.st_mode) ? batch_load_dir(b, list) : batch_load_manifest(b, list);
+    if (!loaded){
+        batch_free(b);
+        return EXIT_FAILURE;
     }
 
-    if (loop(c)){
-        return true;
+    if (b->nworkers == 0){
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        b->nworkers = (cores < 1) ? 1 : (cores > MAX_BATCH_WORKERS) ? MAX_BATCH_WORKERS : (int)cores;
     }
-    
-    if (col(c)){
-        return true;
+    if (b->nworkers > b->njobs){
+        b->nworkers = (b->njobs > 0) ? b->njobs : 1;
     }
 
-    if (set(c)){
-        return true;
+    b->workers = calloc(b->nworkers, sizeof(BatchWorker));
+    if (b->workers == NULL){
+        fprintf(stderr, "failed to allocate memory!");
+        batch_free(b);
+        return EXIT_FAILURE;
     }
 
-    if (rectangle(c)){
-        return true;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int w = 0; w < b->nworkers; w++){ //each worker starts with its own contiguous share of the files
+        BatchWorker* worker = &b->workers[w];
+        worker->batch = b;
+        worker->id = w;
+        worker->head = (int)((long long)b->njobs * w / b->nworkers);
+        worker->tail = (int)((long long)b->njobs * (w + 1) / b->nworkers);
+        pthread_mutex_init(&worker->lock, NULL);
     }
 
-    if (triangle(c)){
-        return true;
+    int started = 0;
+    for (int w = 1; w < b->nworkers; w++){
+        if (pthread_create(&b->workers[w].thread, NULL, batch_worker, &b->workers[w]) != 0){
+            break; //carry on with fewer threads, the rest of the work gets stolen
+        }
+        started = w;
+    }
+    batch_worker(&b->workers[0]); //the main thread is worker 0
+    for (int w = 1; w <= started; w++){
+        pthread_join(b->workers[w].thread, NULL);
     }
 
-    return false;
+    double total = elapsed(start);
+
+    int failed = 0;
+    for (int i = 0; i < b->njobs; i++){ //report in the order the files were listed
+        BatchJob* job = &b->jobs[i];
+        if (job->error.status == TTL_OK){
+            printf("%s %.3f ms\n", job->path, job->seconds * 1e3);
+        }
+        else {
+            printf("%s %.3f ms failed: %s\n", job->path, job->seconds * 1e3, ttl_status_string(job->error.status));
+            failed++;
+        }
+    }
+    printf("%d files, %d failed, %.3f s on %d threads\n", b->njobs, failed, total, b->nworkers);
+
+    for (int w = 0; w < b->nworkers; w++){
+        pthread_mutex_destroy(&b->workers[w].lock);
+    }
+    batch_free(b);
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-bool fwd(Parser* c){
+//one thread of the pool, keeps a single engine for every file it runs so the parser, turtle,
+//stack, tokens, program and canvas are only allocated once per thread
+void* batch_worker(void* arg){
+    BatchWorker* worker = arg;
+    Batch* b = worker->batch;
+    TTLEngine* engine = ttl_engine_create(&b->options);
+    int job;
+
+    while (batch_next(worker, &job) || batch_steal(worker, &job)){
+        if (engine == NULL){
+            b->jobs[job].error.status = TTL_ERR_MEMORY;
+            continue;
+        }
+        batch_run_job(b, engine, &b->jobs[job]);
+    }
 
-    char answer[MAXTOKENSIZE];
-    if (samestr(c->instruction[c->cw], "FORWARD")){
-        c->cw = c->cw + 1;
-        if (var(INSTRUCTION)){ //if variable follows forward, access the variable in the array and set the distance to var value
-            int i = find_var(INSTRUCTION[1]);
-            validVar(i);
-
-            if (c->variable[i].in_use){
-                c->turtle->distance = c->variable[i].value;
-                draw_line(c);
-                if (c->args == 2){ //if only two arguments have been specified 
-                    print_screen(c);
-                }
+    ttl_engine_destroy(engine);
+    return NULL;
+}
+
+//take the next file from the front of this worker's own share
+bool batch_next(BatchWorker* worker, int* job){
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head < worker->tail){
+        *job = worker->head++;
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+//take a file from the back of the share of whichever worker has the most left
+bool batch_steal(BatchWorker* worker, int* job){
+    Batch* b = worker->batch;
+
+    for (;;){
+        int victim = -1;
+        int most = 0;
+
+        for (int w = 0; w < b->nworkers; w++){
+            if (w == worker->id){
+                continue;
             }
-            return true; //if a number has been found in the var function it must be a distance
-        }
-        
-        if (num(INSTRUCTION)){
-            c->turtle->distance = strtod(INSTRUCTION, NULL); //convert string to a double and draw a line
-            draw_line(c);
-            if (c->args == 2){
-                print_screen(c);
+            pthread_mutex_lock(&b->workers[w].lock);
+            int left = b->workers[w].tail - b->workers[w].head;
+            pthread_mutex_unlock(&b->workers[w].lock);
+            if (left > most){
+                most = left;
+                victim = w;
             }
+        }
+        if (victim < 0){
+            return false; //everything has been handed out
+        }
+
+        BatchWorker* v = &b->workers[victim];
+        pthread_mutex_lock(&v->lock); //it may have been emptied since it was counted
+        bool found = (v->head < v->tail);
+        if (found){
+            *job = --v->tail;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (found){
             return true;
         }
+    }
+}
 
-        else {
-            c->cw = c->cw - 1; //go one step back because no value was added
-            ask(INSTRUCTION, answer);
-            c->turtle->distance = strtod(answer, NULL);
-            draw_line(c);
-            if (c->args == 2){
-                print_screen(c);
+void batch_run_job(Batch* b, TTLEngine* engine, BatchJob* job){
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FILE* fp = fopen(job->path, "r");
+    if (fp == NULL){
+        job->error.status = TTL_ERR_IO;
+        snprintf(job->error.message, sizeof(job->error.message), "failed to locate file!");
+    }
+    else {
+        if (ttl_engine_run_file(engine, fp, &job->error) == TTL_OK){
+            char out[PATH_MAX];
+            batch_output_name(b, job->path, out, sizeof(out));
+            FILE* wp = fopen(out, "w");
+            if (wp == NULL){
+                job->error.status = TTL_ERR_IO;
+                snprintf(job->error.message, sizeof(job->error.message), "failed to locate file to write to!");
+            }
+            else {
+                ttl_engine_write(engine, wp, &job->error);
+                if ((fclose(wp) != 0) && (job->error.status == TTL_OK)){
+                    job->error.status = TTL_ERR_IO;
+                    snprintf(job->error.message, sizeof(job->error.message), "failed to write to output file!");
+                }
             }
-            return true;
         }
+        fclose(fp);
     }
-    return false;
+
+    job->seconds = elapsed(start);
 }
 
-bool rgt(Parser* c){
-    char answer[MAXTOKENSIZE];
+//outdir/name.txt for a file called name.ttl, any other name just gets .txt added. other formats
+//get their own extension instead of .txt
+void batch_output_name(Batch* b, const char* path, char* out, size_t size){
+    const char* name = strrchr(path, '/');
+    name = (name == NULL) ? path : name + 1;
 
-    if (samestr(c->instruction[c->cw], "RIGHT")){
-        c->cw = c->cw + 1;
+    size_t length = strlen(name);
+    if ((length > 4) && samestr(name + length - 4, ".ttl")){
+        length -= 4;
+    }
+    snprintf(out, size, "%s/%.*s.%s", b->outdir, (int)length, name, format_extension(b->options.format));
+}
+
+bool batch_add(Batch* b, const char* path){
+    if (b->njobs == b->capacity){
+        int capacity = (b->capacity == 0) ? PROGRAM_START_SIZE : b->capacity * 2;
+        BatchJob* jobs = realloc(b->jobs, capacity * sizeof(BatchJob));
+        if (jobs == NULL){
+            fprintf(stderr, "failed to allocate memory!");
+            return false;
+        }
+        b->jobs = jobs;
+        b->capacity = capacity;
+    }
+
+    BatchJob* job = &b->jobs[b->njobs];
+    memset(job, 0, sizeof(BatchJob));
+    job->path = strdup(path);
+    if (job->path == NULL){
+        fprintf(stderr, "failed to allocate memory!");
+        return false;
+    }
+    b->njobs++;
+    return true;
+}
+
+//one path per line, blank lines are skipped
+bool batch_load_manifest(Batch* b, const char* list){
+    FILE* fp = fopen(list, "r");
+    char line[PATH_MAX];
+
+    if (fp == NULL){
+        fprintf(stderr, "failed to locate file!");
+        return false;
+    }
 
-        if (var(INSTRUCTION)){ //if var found, set angle to be current angle - variable.value
-            int i = find_var(INSTRUCTION[1]);
-            validVar(i);
+    while (fgets(line, sizeof(line), fp) != NULL){
+        line[strcspn(line, "\r\n")] = '\0';
+        if ((line[0] != '\0') && !batch_add(b, line)){
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+//every .ttl file in the directory, sorted by name so runs are repeatable
+bool batch_load_dir(Batch* b, const char* dir){
+    struct dirent** names;
+    char path[PATH_MAX];
+    bool ok = true;
+
+    int n = scandir(dir, &names, NULL, alphasort);
+    if (n < 0){
+        fprintf(stderr, "failed to locate file!");
+        return false;
+    }
+
+    for (int i = 0; i < n; i++){
+        size_t length = strlen(names[i]->d_name);
+        if (ok && (length > 4) && samestr(names[i]->d_name + length - 4, ".ttl")){
+            snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+            ok = batch_add(b, path);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ok;
+}
+
+void batch_free(Batch* b){
+    for (int i = 0; i < b->njobs; i++){
+        free(b->jobs[i].path);
+    }
+    free(b->jobs);
+    free(b->workers);
+    b->jobs = NULL;
+    b->workers = NULL;
+    b->njobs = 0;
+}
+
+//answer render requests on a unix socket until killed. every connection gets a reader thread that
+//queues its requests and a writer thread that sends the replies back in the order they were asked
+//for, so a client can send many requests without waiting. a fixed pool of workers, each with its
+//own warm engine, takes jobs from one bounded queue
+int run_server(Server* sv, const TTLOptions* options, int nworkers){
+    struct sockaddr_un address;
+
+    sv->defaults = *options;
+    sv->defaults.screen = false;
+    sv->defaults.ask = NULL; //nobody can answer a question over the socket
+    sv->defaults.mmap_output = false; //replies are built in memory
+    sv->defaults.record = NULL;
+    sv->defaults.publish = NULL;
+    sv->nworkers = (nworkers > 0) ? nworkers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (sv->nworkers < 1){
+        sv->nworkers = 1;
+    }
+
+    if (!socket_address(sv->path, &address)){
+        return EXIT_FAILURE;
+    }
+    sv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sv->fd < 0){
+        fprintf(stderr, "failed to create socket!");
+        return EXIT_FAILURE;
+    }
+    unlink(sv->path); //clear out a socket left behind by an earlier server
+    if ((bind(sv->fd, (struct sockaddr*)&address, sizeof(address)) != 0) || (listen(sv->fd, SOMAXCONN) != 0)){
+        fprintf(stderr, "failed to listen on %s!", sv->path);
+        close(sv->fd);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN); //a client hanging up is handled where the write fails
+
+    pthread_mutex_init(&sv->lock, NULL);
+    pthread_cond_init(&sv->not_empty, NULL);
+    pthread_cond_init(&sv->not_full, NULL);
+    pthread_cond_init(&sv->done, NULL);
+
+    for (int w = 0; w < sv->nworkers; w++){
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, sv) != 0){
+            fprintf(stderr, "failed to start worker threads!");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+
+    for (;;){
+        int fd = accept(sv->fd, NULL, NULL);
+        if (fd < 0){
+            continue;
+        }
+
+        Connection* cn = calloc(1, sizeof(Connection));
+        if (cn == NULL){
+            close(fd);
+            continue;
+        }
+        cn->fd = fd;
+        cn->server = sv;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_reader, cn) != 0){
+            close(fd);
+            free(cn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+//one worker of the pool, keeps the same engine for every job and only remakes the canvas when a
+//request asks for a different size or kind
+void* server_worker(void* arg){
+    Server* sv = arg;
+    TTLEngine* engine = ttl_engine_create(&sv->defaults);
+
+    for (;;){
+        pthread_mutex_lock(&sv->lock);
+        while (sv->head == NULL){
+            pthread_cond_wait(&sv->not_empty, &sv->lock);
+        }
+        ServerJob* job = sv->head;
+        sv->head = job->next;
+        if (sv->head == NULL){
+            sv->tail = NULL;
+        }
+        sv->queued--;
+        pthread_cond_signal(&sv->not_full);
+        pthread_mutex_unlock(&sv->lock);
+
+        if (engine == NULL){
+            engine = ttl_engine_create(&sv->defaults);
+        }
+        if ((engine == NULL) || (ttl_engine_set_options(engine, &job->options) != TTL_OK)){
+            job->error.status = TTL_ERR_MEMORY;
+            snprintf(job->error.message, sizeof(job->error.message), "failed to allocate memory!");
+        }
+        else if (ttl_engine_run(engine, job->source, job->size, &job->error) == TTL_OK){
+            FILE* out = open_memstream(&job->output, &job->output_size);
+            if (out == NULL){
+                job->error.status = TTL_ERR_MEMORY;
+                snprintf(job->error.message, sizeof(job->error.message), "failed to allocate output memory!");
+            }
+            else {
+                ttl_engine_write(engine, out, &job->error);
+                fclose(out);
+            }
+        }
+        free(job->source);
+        job->source = NULL;
+
+        pthread_mutex_lock(&sv->lock);
+        job->done = true;
+        pthread_cond_broadcast(&sv->done); //wake the writer waiting on this job
+        pthread_mutex_unlock(&sv->lock);
+    }
+    return NULL;
+}
+
+//read requests off a connection and queue them, blocks while the queue is full
+void* connection_reader(void* arg){
+    Connection* cn = arg;
+    Server* sv = cn->server;
+    pthread_t writer;
+
+    FILE* in = fdopen(dup(cn->fd), "r");
+    if ((in == NULL) || (pthread_create(&writer, NULL, connection_writer, cn) != 0)){
+        if (in != NULL){
+            fclose(in);
+        }
+        close(cn->fd);
+        free(cn);
+        return NULL;
+    }
+
+    ServerJob* job;
+    while ((job = read_request(sv, in)) != NULL){
+        pthread_mutex_lock(&sv->lock);
+        while (sv->queued >= sv->capacity){
+            pthread_cond_wait(&sv->not_full, &sv->lock);
+        }
+        if (sv->tail == NULL){
+            sv->head = job;
+        }
+        else {
+            sv->tail->next = job;
+        }
+        sv->tail = job;
+        sv->queued++;
+
+        if (cn->last == NULL){ //and remember it so the reply goes out in order
+            cn->first = job;
+        }
+        else {
+            cn->last->reply_next = job;
+        }
+        cn->last = job;
+        pthread_cond_signal(&sv->not_empty);
+        pthread_mutex_unlock(&sv->lock);
+    }
+
+    pthread_mutex_lock(&sv->lock);
+    cn->finished = true;
+    pthread_cond_broadcast(&sv->done);
+    pthread_mutex_unlock(&sv->lock);
+
+    pthread_join(writer, NULL);
+    fclose(in);
+    close(cn->fd);
+    free(cn);
+    return NULL;
+}
+
+//send replies in request order as each one is finished
+void* connection_writer(void* arg){
+    Connection* cn = arg;
+    Server* sv = cn->server;
+    bool connected = true;
+
+    for (;;){
+        pthread_mutex_lock(&sv->lock);
+        while (!((cn->first != NULL) && cn->first->done) && !((cn->first == NULL) && cn->finished)){
+            pthread_cond_wait(&sv->done, &sv->lock);
+        }
+        ServerJob* job = cn->first;
+        if (job != NULL){
+            cn->first = job->reply_next;
+            if (cn->first == NULL){
+                cn->last = NULL;
+            }
+        }
+        pthread_mutex_unlock(&sv->lock);
+
+        if (job == NULL){
+            return NULL; //reader has stopped and every reply has been sent
+        }
+
+        if (connected){ //after a failed write the rest of the replies are just dropped
+            char header[MAX_HEADER_SIZE];
+            if (job->error.status == TTL_OK){
+                int n = snprintf(header, sizeof(header), "OK %zu\n", job->output_size);
+                connected = write_full(cn->fd, header, n) && write_full(cn->fd, job->output, job->output_size);
+            }
+            else {
+                size_t length = strlen(job->error.message);
+                int n = snprintf(header, sizeof(header), "ERR %d %d %zu\n", (int)job->error.status, job->error.line, length);
+                connected = write_full(cn->fd, header, n) && write_full(cn->fd, job->error.message, length);
+            }
+            if (!connected){
+                shutdown(cn->fd, SHUT_RD); //stop the reader too
+            }
+        }
+        free(job->output);
+        free(job);
+    }
+}
+
+//a request is one header line followed by the TTL source:
+//RUN <source bytes> <width> <height> <sparse> <legacy raster> <viewport> <x> <y> <width> <height>
+//    <format> <fixed> <display list> <raster threads> <packed> <scale>
+//fields after the first ten can be left out from the end, they then take the server's defaults.
+//returns NULL at the end of the connection or on a request that can't be read
+ServerJob* read_request(Server* sv, FILE* in){
+    char header[MAX_HEADER_SIZE];
+    int sparse;
+    int legacy;
+    int viewport;
+    int format;
+    int fixed;
+    int display;
+    int packed;
+
+    if (fgets(header, sizeof(header), in) == NULL){
+        return NULL;
+    }
+
+    ServerJob* job = calloc(1, sizeof(ServerJob));
+    if (job == NULL){
+        return NULL;
+    }
+    job->options = sv->defaults;
+    TTLOptions* o = &job->options;
+
+    format = o->format;
+    fixed = o->fixed;
+    display = o->display_list;
+    packed = o->packed;
+    int fields = sscanf(header, "RUN %zu %d %d %d %d %d %lld %lld %d %d %d %d %d %d %d %d", &job->size, &o->width, &o->height,
+                        &sparse, &legacy, &viewport, &o->view_x, &o->view_y, &o->view_width, &o->view_height, &format, &fixed,
+                        &display, &o->raster_threads, &packed, &o->scale);
+
+    if ((fields < 10) || (job->size > MAX_REQUEST_SIZE) || (o->width < 1) || (o->width > MAX_CANVAS_SIZE) || (o->height < 1) ||
+        (o->height > MAX_CANVAS_SIZE) || (viewport && ((o->view_width < 1) || (o->view_width > MAX_CANVAS_SIZE) ||
+        (o->view_height < 1) || (o->view_height > MAX_CANVAS_SIZE))) || (format < TTL_FORMAT_TEXT) || (format > TTL_FORMAT_PAM) ||
+        (o->raster_threads < 0) || (o->raster_threads > MAX_BATCH_WORKERS) || (o->scale < 0) || (o->scale > MAX_IMAGE_SCALE)){
+        free(job);
+        return NULL; //a bad header means the stream can't be followed any more
+    }
+    o->sparse = sparse;
+    o->legacy_raster = legacy;
+    o->viewport = viewport;
+    o->format = format;
+    o->fixed = fixed;
+    o->display_list = display || (o->raster_threads > 0);
+    o->packed = packed;
+
+    job->source = malloc(job->size + 1);
+    if ((job->source == NULL) || (fread(job->source, 1, job->size, in) != job->size)){
+        free(job->source);
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+//an option the RUN header can't carry, because it only acts where the program runs, NULL if there
+//isn't one. --connect refuses these rather than quietly dropping them
+const char* local_option(const TTLOptions* o){
+    if (o->mmap_output){
+        return "--mmap-output";
+    }
+    if (o->stats){
+        return "--stats"; //the server's parse and run times aren't sent back
+    }
+    if (o->raster_bench){
+        return "--raster-bench";
+    }
+    if (o->record_path != NULL){
+        return "--record"; //the log is written by whoever draws
+    }
+    if (o->publish != NULL){
+        return "--publish";
+    }
+    return NULL;
+}
+
+//send every file to the server down one connection, then read the replies back in the same order.
+//with batch set the file arguments are a manifest or directory and an output directory
+int run_client(Server* sv, const TTLOptions* options, int nfiles, char** files, bool batch){
+    struct sockaddr_un address;
+    Batch b;
+    int failed = 0;
+
+    memset(&b, 0, sizeof(Batch));
+    b.options = *options; //names the outputs with the format's extension
+    const char* local = local_option(options);
+    if (local != NULL){
+        fprintf(stderr, "%s only works without --connect!", local);
+        return EXIT_FAILURE;
+    }
+    if (batch){
+        struct stat st;
+        if ((nfiles != 2) || (stat(files[0], &st) != 0)){
+            fprintf(stderr, "failed to locate file!");
+            return EXIT_FAILURE;
+        }
+        if (!(S_ISDIR(st.st_mode) ? batch_load_dir(&b, files[0]) : batch_load_manifest(&b, files[0]))){
+            batch_free(&b);
+            return EXIT_FAILURE;
+        }
+        b.outdir = files[1];
+    }
+    else if (!batch_add(&b, files[0])){
+        return EXIT_FAILURE;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd < 0) || !socket_address(sv->path, &address) || (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)){
+        fprintf(stderr, "failed to connect to %s!", sv->path);
+        batch_free(&b);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ClientSend send = {fd, &b, *options, EXIT_SUCCESS};
+    pthread_t sender;
+    if (pthread_create(&sender, NULL, client_send, &send) != 0){
+        close(fd);
+        batch_free(&b);
+        return EXIT_FAILURE;
+    }
+
+    FILE* in = fdopen(fd, "r");
+    for (int i = 0; (in != NULL) && (i < b.njobs); i++){
+        if (!client_receive(in, &b, i, batch ? NULL : ((nfiles > 1) ? files[1] : "-"))){
+            failed++;
+        }
+    }
+
+    pthread_join(sender, NULL);
+    if (in != NULL){
+        fclose(in);
+    }
+    else {
+        close(fd);
+    }
+    batch_free(&b);
+    return ((failed == 0) && (send.status == EXIT_SUCCESS)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//write every request without waiting for replies, runs beside the reader so neither side stalls
+void* client_send(void* arg){
+    ClientSend* send = arg;
+    char header[MAX_HEADER_SIZE];
+    const TTLOptions* o = &send->options;
+
+    for (int i = 0; i < send->batch->njobs; i++){
+        char* source = NULL;
+        size_t size = 0;
+        if (!read_file(send->batch->jobs[i].path, &source, &size)){
+            fprintf(stderr, "failed to locate file %s!\n", send->batch->jobs[i].path);
+            send->status = EXIT_FAILURE;
+            break;
+        }
+
+        int n = snprintf(header, sizeof(header), "RUN %zu %d %d %d %d %d %lld %lld %d %d %d %d %d %d %d %d\n", size, o->width,
+                         o->height, o->sparse, o->legacy_raster, o->viewport, o->view_x, o->view_y, o->view_width, o->view_height,
+                         o->format, o->fixed, o->display_list, o->raster_threads, o->packed, o->scale);
+        bool sent = write_full(send->fd, header, n) && write_full(send->fd, source, size);
+        free(source);
+        if (!sent){
+            send->status = EXIT_FAILURE;
+            break;
+        }
+    }
+    shutdown(send->fd, SHUT_WR); //tells the server there are no more requests
+    return NULL;
+}
+
+//read one reply, out names the file to write the grid to, "-" for stdout and NULL for the batch
+//output directory
+bool client_receive(FILE* in, Batch* b, int i, const char* out){
+    char header[MAX_HEADER_SIZE];
+    char path[PATH_MAX];
+    size_t size;
+    int status;
+    int line;
+
+    if (fgets(header, sizeof(header), in) == NULL){
+        fprintf(stderr, "%s: no reply from server!\n", b->jobs[i].path);
+        return false;
+    }
+
+    if (sscanf(header, "ERR %d %d %zu", &status, &line, &size) == 3){
+        char message[ERROR_MESSAGE_SIZE];
+        size_t n = (size < sizeof(message)) ? size : sizeof(message) - 1;
+        if (fread(message, 1, n, in) != n){
+            return false;
+        }
+        message[n] = '\0';
+        for (size_t skip = n; skip < size; skip++){ //drop whatever didn't fit so the next reply lines up
+            fgetc(in);
+        }
+        fprintf(stderr, "%s: line %d: %s", b->jobs[i].path, line, message);
+        return false;
+    }
+
+    if (sscanf(header, "OK %zu", &size) != 1){
+        fprintf(stderr, "%s: bad reply from server!\n", b->jobs[i].path);
+        return false;
+    }
+
+    if (out == NULL){
+        batch_output_name(b, b->jobs[i].path, path, sizeof(path));
+        out = path;
+    }
+    FILE* wp = samestr(out, "-") ? stdout : fopen(out, "w");
+    if (wp == NULL){
+        fprintf(stderr, "failed to locate file to write to!");
+        return false;
+    }
+
+    char buffer[OUTPUT_CHUNK / 16];
+    bool ok = true;
+    while (size > 0){ //copy the grid across a buffer at a time
+        size_t n = (size < sizeof(buffer)) ? size : sizeof(buffer);
+        if (fread(buffer, 1, n, in) != n){
+            ok = false;
+            break;
+        }
+        if (fwrite(buffer, 1, n, wp) != n){
+            ok = false;
+        }
+        size -= n;
+    }
+    if (wp != stdout){
+        fclose(wp);
+    }
+    return ok;
+}
+
+bool socket_address(const char* path, struct sockaddr_un* address){
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)){
+        fprintf(stderr, "socket path %s is too long!", path);
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+bool write_full(int fd, const char* data, size_t size){
+    while (size > 0){
+        ssize_t n = write(fd, data, size);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_file(const char* path, char** data, size_t* size){
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL){
+        return false;
+    }
+
+    TTLStatus status = read_stream(fp, data, size);
+    fclose(fp);
+    return (status == TTL_OK);
+}
+
+bool load_ins(Parser* c, FILE* fp){
+    struct stat st;
+    int fd = fileno(fp);
+
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)){ //regular files are mapped straight into memory
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED){
+            madvise(map, st.st_size, MADV_SEQUENTIAL); //the lexer reads the file front to back once
+            c->source = map;
+            c->source_size = st.st_size;
+            c->mapped = true;
+        }
+    }
+
+    if (!c->mapped){ //pipes, empty files or a failed mapping are read into memory instead
+        return read_source(c, fp);
+    }
+    return true;
+}
+
+bool read_source(Parser* c, FILE* fp){
+    char* text;
+    size_t size;
+
+    TTLStatus status = read_stream(fp, &text, &size);
+    if (status == TTL_ERR_MEMORY){
+        return fail(c, TTL_ERR_MEMORY, "failed to allocate source memory!");
+    }
+    if (status != TTL_OK){
+        return fail(c, TTL_ERR_IO, "failed to read file!");
+    }
+    c->source = text;
+    c->source_size = size;
+    c->owned = true;
+    return true;
+}
+
+//read the rest of fp into a buffer that grows as needed, for pipes and files that can't be mapped.
+//on success the caller frees *data
+TTLStatus read_stream(FILE* fp, char** data, size_t* size){
+    size_t capacity = SOURCE_START_SIZE;
+    char* text = malloc(capacity);
+
+    *size = 0;
+    while (text != NULL){
+        *size += fread(text + *size, 1, capacity - *size, fp);
+        if (*size < capacity){ //fread came up short so the whole file has been read
+            break;
+        }
+        capacity *= 2;
+        char* bigger = realloc(text, capacity);
+        if (bigger == NULL){
+            free(text);
+        }
+        text = bigger;
+    }
+
+    if (text == NULL){
+        return TTL_ERR_MEMORY;
+    }
+    if (ferror(fp)){ //fread also comes up short on a read error
+        free(text);
+        return TTL_ERR_IO;
+    }
+    *data = text;
+    return TTL_OK;
+}
+
+//split the source into whitespace separated tokens, recording where each one is instead of copying it
+bool lex(Parser* c){
+    const char* src = c->source;
+    size_t i = 0;
+
+    while (i < c->source_size){
+        if (isspace((unsigned char)src[i])){
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while ((i < c->source_size) && !isspace((unsigned char)src[i])){
+            i++;
+        }
+        if (!add_token(c, start, i - start, token_kind(src + start, i - start))){
+            return false;
+        }
+    }
+
+    return add_token(c, c->source_size, 0, TOK_EOF); //marks the end of the program for the parser
+}
+
+bool add_token(Parser* c, size_t offset, size_t length, TokenKind kind){
+    if (c->ntokens == c->token_capacity){ //double the token array whenever it fills up
+        int capacity = (c->token_capacity == 0) ? TOKENS_START_SIZE : c->token_capacity * 2;
+        Token* tokens = realloc(c->tokens, capacity * sizeof(Token));
+        if (tokens == NULL){
+            return fail(c, TTL_ERR_MEMORY, "failed to allocate token memory!");
+        }
+        c->tokens = tokens;
+        c->token_capacity = capacity;
+    }
+
+    Token* t = &c->tokens[c->ntokens++];
+    t->offset = offset;
+    t->length = length;
+    t->kind = kind;
+    return true;
+}
+
+TokenKind token_kind(const char* text, size_t length){
+    double value;
+
+    if ((length == 2) && (text[0] == '$') && ltr(text[1])){ //the $ and a single letter
+        return TOK_VAR;
+    }
+
+    if ((text[0] == '\"') && (text[length - 1] == '\"')){ //starts and ends with double quotations
+        return TOK_WORD;
+    }
+
+    if (lex_number(text, length, &value)){
+        return TOK_NUM;
+    }
+
+    return TOK_NAME;
+}
+
+//tokens aren't null terminated, so numbers are copied into a small buffer before strtod reads them
+bool lex_number(const char* text, size_t length, double* value){
+    char number[MAXTOKENSIZE];
+    char* endptr = NULL;
+
+    if (length >= MAXTOKENSIZE){ //far too long to be a number
+        return false;
+    }
+
+    memcpy(number, text, length);
+    number[length] = '\0';
+    *value = strtod(number, &endptr);
+
+    return ((length > 0) && (*endptr == '\0')); //the whole token has to be used up by the number
+}
+
+const char* token_text(Parser* c, Token t){
+    if (t.kind == TOK_EOF){
+        return ""; //the end marker has no text in the source
+    }
+    return c->source + t.offset;
+}
+
+bool token_is(Parser* c, Token t, char* s){
+    size_t length = strlen(s);
+    return ((t.length == length) && (memcmp(token_text(c, t), s, length) == 0));
+}
+
+double token_num(Parser* c, Token t){
+    double value = 0;
+    lex_number(token_text(c, t), t.length, &value);
+    return value;
+}
+
+ColourCode token_col(Parser* c, Token t){
+    if (t.kind != TOK_WORD){
+        return '\0';
+    }
+    return colour_code(token_text(c, t), t.length);
+}
+
+bool stack_init(Parser* c){
+    c->stack = calloc(1, sizeof(Stack));
+    if (c->stack == NULL){
+        return false;
+    }
+    c->stack->top = EMPTY_STACK; //initialise stack pointer to signal an empty stack
+    return true;
+}
+
+bool turtle_init(Parser* c){
+    pthread_once(&trig_once, trig_init); //shared by every engine, only made once
+    c->turtle = calloc(1, sizeof(Turtle)); 
+    if (c->turtle == NULL){
+        return false;
+    }
+
+    if (c->options.sparse){
+        return sparse_init(&c->turtle->grid, c->options.width, c->options.height);
+    }
+    return canvas_init(&c->turtle->grid, c->options.width, c->options.height, c->options.packed);
+}
+
+void trig_init(void){
+    for (int d = -TRIG_RANGE; d <= TRIG_RANGE; d++){
+        double angleRadians = d * (M_PI / 180.0); //convert angle to radians to use cos and sin functions
+        trig_cos[d + TRIG_RANGE] = cos(angleRadians);
+        trig_sin[d + TRIG_RANGE] = sin(angleRadians);
+    }
+}
+
+//face the turtle a new way and work out the direction it will move in, whole degrees come from
+//the table and anything else is worked out directly
+void turn_to(Turtle* t, double angle){
+    t->angle = angle;
+
+    if (t->fixed){
+        fixed_heading(angle, &t->fixed_x, &t->fixed_y);
+        return;
+    }
+
+    if ((angle >= -TRIG_RANGE) && (angle <= TRIG_RANGE) && (angle == (int)angle)){
+        t->heading_x = trig_cos[(int)angle + TRIG_RANGE];
+        t->heading_y = trig_sin[(int)angle + TRIG_RANGE];
+        return;
+    }
+
+    double angleRadians = angle * (M_PI / 180.0);
+    t->heading_x = cos(angleRadians);
+    t->heading_y = sin(angleRadians);
+}
+
+//cos and sin of angle as 8.24 fixed point, worked out with integer CORDIC rotations so the result
+//is the same on every machine and compiler. only the angle itself is turned into an integer with
+//fmod and llround, which are exact
+void fixed_heading(double angle, long long* cos_out, long long* sin_out){
+    long long z = llround(fmod(angle, 360.0) * FIXED_DEGREE); //now strictly between -360 and 360 degrees
+    long long x = CORDIC_GAIN; //starts shrunk by the growth the rotations add
+    long long y = 0;
+    bool flip = false;
+
+    if (z > 180 * FIXED_DEGREE){
+        z -= 360 * FIXED_DEGREE;
+    }
+    if (z <= -180 * FIXED_DEGREE){
+        z += 360 * FIXED_DEGREE;
+    }
+    if (z > 90 * FIXED_DEGREE){ //CORDIC only reaches 90 degrees either way, the rest is a half turn away
+        z -= 180 * FIXED_DEGREE;
+        flip = true;
+    }
+    else if (z < -90 * FIXED_DEGREE){
+        z += 180 * FIXED_DEGREE;
+        flip = true;
+    }
+
+    if ((z == 0) || (z == 90 * FIXED_DEGREE) || (z == -90 * FIXED_DEGREE)){ //right angles come out exact
+        x = (z == 0) ? (1LL << CORDIC_SHIFT) : 0;
+        y = (z == 0) ? 0 : (z > 0) ? (1LL << CORDIC_SHIFT) : -(1LL << CORDIC_SHIFT);
+    }
+    else {
+        for (int i = 0; i < CORDIC_STEPS; i++){
+            long long dx = floor_div(y, 1LL << i); //not >>, which is implementation defined for negative numbers
+            long long dy = floor_div(x, 1LL << i);
+            if (z >= 0){
+                x -= dx;
+                y += dy;
+                z -= cordic_atan[i];
+            }
+            else {
+                x += dx;
+                y -= dy;
+                z += cordic_atan[i];
+            }
+        }
+    }
+
+    if (flip){
+        x = -x;
+        y = -y;
+    }
+    *cos_out = floor_div(x + (1LL << (CORDIC_SHIFT - HEADING_SHIFT - 1)), 1LL << (CORDIC_SHIFT - HEADING_SHIFT)); //round to the nearest 8.24
+    *sin_out = floor_div(y + (1LL << (CORDIC_SHIFT - HEADING_SHIFT - 1)), 1LL << (CORDIC_SHIFT - HEADING_SHIFT));
+}
+
+//move in fixed point, the position keeps its fraction between moves instead of being cut to a
+//whole cell every time, and the line is drawn between the nearest cells
+void calc_position_fixed(Turtle* t){
+    double distance = t->distance;
+
+    if (!(fabs(distance) < FIXED_MAX_DISTANCE)){ //too far to multiply without overflowing, or not a number
+        distance = isnan(distance) ? 0 : copysign(FIXED_MAX_DISTANCE, distance);
+    }
+    long long d = llround(distance * FIXED_ONE);
+
+    t->fx = fixed_position(t->fx + fixed_mul(t->fixed_x, d));
+    t->fy = fixed_position(t->fy - fixed_mul(t->fixed_y, d)); //subtract for y because screen coordinates increase as you go down
+
+    t->oldX = t->x;
+    t->oldY = t->y;
+    t->x = (double)floor_div(t->fx + FIXED_ONE / 2, FIXED_ONE);
+    t->y = (double)floor_div(t->fy + FIXED_ONE / 2, FIXED_ONE);
+}
+
+//stop a 24.8 position at MAX_POSITION cells from (0, 0) like move_position does, so moves can't add up
+//past 64 bits. a position is at most 2^48 and a move 2^38, so the sum before this always fits
+long long fixed_position(long long f){
+    long long most = (long long)MAX_POSITION * FIXED_ONE;
+    return (f > most) ? most : (f < -most) ? -most : f;
+}
+
+//8.24 heading times 24.8 distance, rounded half away from zero to 24.8
+long long fixed_mul(long long heading, long long distance){
+    long long p = heading * distance;
+    long long half = 1LL << (HEADING_SHIFT - 1);
+    return (p >= 0) ? ((p + half) >> HEADING_SHIFT) : -((-p + half) >> HEADING_SHIFT);
+}
+
+//put the turtle back at the start with a clean grid
+void turtle_reset(Parser* c){
+    c->turtle->y = (c->options.height/2);
+    c->turtle->x = (c->options.width/2); //set starting positions
+    c->turtle->oldY = 0;
+    c->turtle->oldX = 0;
+    c->turtle->distance = 0;
+    c->turtle->fixed = c->options.fixed;
+    c->turtle->fx = (long long)c->turtle->x * FIXED_ONE;
+    c->turtle->fy = (long long)c->turtle->y * FIXED_ONE;
+    turn_to(c->turtle, FWDANGLE); //set starting angle
+    c->turtle->colour = 'W'; //set starting colour
+    canvas_clear(&c->turtle->grid);
+}
+
+bool canvas_init(Canvas* g, int width, int height, bool packed){
+    pthread_once(&packed_once, packed_init);
+    int bytes = packed ? (width + 1) / 2 : width; //bytes in a row before padding
+
+    g->kind = CANVAS_DENSE;
+    g->packed = packed;
+    g->width = width;
+    g->height = height;
+    g->stride = ((bytes + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE; //pad every row out to a whole number of cache lines
+    g->band_top = 0;
+    g->band_bottom = height;
+    g->cells = aligned_alloc(CACHE_LINE, (size_t)g->stride * height);
+    if (g->cells == NULL){
+        return false;
+    }
+    canvas_clear(g);
+    return true;
+}
+
+//a sparse canvas has no edges, width and height only decide where the turtle starts
+bool sparse_init(Canvas* g, int width, int height){
+    g->kind = CANVAS_SPARSE;
+    g->width = width;
+    g->height = height;
+    g->tile_slots = TILE_SLOTS_START;
+    g->tiles = calloc(g->tile_slots, sizeof(Tile*));
+    if (g->tiles == NULL){
+        return false;
+    }
+    canvas_clear(g);
+    return true;
+}
+
+//wipe everything drawn, a sparse canvas gives back its tiles
+void canvas_clear(Canvas* g){
+    g->out_of_memory = false;
+
+    if (g->kind == CANVAS_DENSE){
+        memset(g->cells, '\0', (size_t)g->stride * g->height); //populate the turtle grid with null characters, packed code 0 is empty too
+        return;
+    }
+
+    for (size_t i = 0; i < g->tile_slots; i++){
+        free(g->tiles[i]);
+        g->tiles[i] = NULL;
+    }
+    g->ntiles = 0;
+    g->last = NULL;
+    g->min_x = LLONG_MAX;
+    g->min_y = LLONG_MAX;
+    g->max_x = LLONG_MIN;
+    g->max_y = LLONG_MIN; //nothing drawn yet
+}
+
+void canvas_free(Canvas* g){
+    free(g->cells);
+    g->cells = NULL;
+
+    for (size_t i = 0; i < g->tile_slots; i++){
+        free(g->tiles[i]);
+    }
+    free(g->tiles);
+    g->tiles = NULL;
+    g->tile_slots = 0;
+    g->ntiles = 0;
+    g->last = NULL;
+}
+
+void canvas_plot(Canvas* g, long long x, long long y, ColourCode colour){
+    if (g->kind == CANVAS_DENSE){
+        if (g->packed){
+            packed_set(g, x, y, colour);
+            return;
+        }
+        CELL(g, x, y) = colour;
+        return;
+    }
+
+    Tile* t = find_tile(g, tile_of(x), tile_of(y), true);
+    if (t == NULL){
+        g->out_of_memory = true; //picked up by draw_line
+        return;
+    }
+    t->cells[tile_cell(x, y)] = colour;
+
+    if (x < g->min_x){ //grow the bounding box of everything drawn so far
+        g->min_x = x;
+    }
+    if (x > g->max_x){
+        g->max_x = x;
+    }
+    if (y < g->min_y){
+        g->min_y = y;
+    }
+    if (y > g->max_y){
+        g->max_y = y;
+    }
+}
+
+void packed_init(void){
+    for (int b = 0; b < 256; b++){
+        packed_pairs[b][0] = ((b & 0xF) < PACKED_CODES) ? packed_colours[b & 0xF] : '\0'; //even cell in the low half
+        packed_pairs[b][1] = ((b >> 4) < PACKED_CODES) ? packed_colours[b >> 4] : '\0';
+    }
+}
+
+void packed_set(Canvas* g, long long x, long long y, ColourCode colour){
+    unsigned char* cell = (unsigned char*)&PACKED_BYTE(g, x, y);
+    int shift = (x & 1) * 4;
+    *cell = (*cell & ~(0xF << shift)) | (packed_codes[(unsigned char)colour] << shift);
+}
+
+ColourCode packed_get(Canvas* g, long long x, long long y){
+    unsigned char cell = PACKED_BYTE(g, x, y);
+    return packed_pairs[cell][x & 1];
+}
+
+//set cells from to to of row y, the whole bytes in between are filled with one memset
+void packed_fill(Canvas* g, long long y, long long from, long long to, ColourCode colour){
+    unsigned char code = packed_codes[(unsigned char)colour];
+
+    if (from & 1){ //odd start shares its byte with the cell before
+        packed_set(g, from, y, colour);
+        from++;
+    }
+    if (!(to & 1) && (to >= from)){ //even end shares its byte with the cell after
+        packed_set(g, to, y, colour);
+        to--;
+    }
+    if (to > from){
+        memset(&PACKED_BYTE(g, from, y), code | (code << 4), (to - from + 1) / 2);
+    }
+}
+
+//turn n packed cells of a row starting at cell x back into colours, two cells per table lookup
+void packed_row(Canvas* g, long long x, long long y, long long n, char* dst){
+    const unsigned char* src = (const unsigned char*)&PACKED_BYTE(g, x, y);
+
+    if ((n > 0) && (x & 1)){
+        *dst++ = packed_pairs[*src++][1];
+        n--;
+    }
+    for (; n >= 2; n -= 2){
+        memcpy(dst, packed_pairs[*src++], 2);
+        dst += 2;
+    }
+    if (n > 0){
+        *dst = packed_pairs[*src][0];
+    }
+}
+
+//look up the tile at tile coordinates tx, ty in the open addressing tile index, making it if create is set
+Tile* find_tile(Canvas* g, long long tx, long long ty, bool create){
+    if ((g->last != NULL) && (g->last->tx == tx) && (g->last->ty == ty)){
+        return g->last; //lines usually stay in the same tile for a while
+    }
+
+    size_t mask = g->tile_slots - 1;
+    size_t i = tile_hash(tx, ty) & mask;
+    while (g->tiles[i] != NULL){
+        if ((g->tiles[i]->tx == tx) && (g->tiles[i]->ty == ty)){
+            g->last = g->tiles[i];
+            return g->last;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (!create){
+        return NULL;
+    }
+
+    if ((g->ntiles + 1) * 2 > g->tile_slots){ //keep the index at most half full
+        if (!grow_tiles(g)){
+            return NULL;
+        }
+        mask = g->tile_slots - 1;
+        i = tile_hash(tx, ty) & mask; //find the free slot again in the bigger index
+        while (g->tiles[i] != NULL){
+            i = (i + 1) & mask;
+        }
+    }
+
+    Tile* t = calloc(1, sizeof(Tile)); //tiles start out full of null characters
+    if (t == NULL){
+        return NULL;
+    }
+    t->tx = tx;
+    t->ty = ty;
+    g->tiles[i] = t;
+    g->ntiles++;
+    g->last = t;
+    return t;
+}
+
+bool grow_tiles(Canvas* g){
+    size_t slots = g->tile_slots * 2;
+    Tile** tiles = calloc(slots, sizeof(Tile*));
+    if (tiles == NULL){
+        return false;
+    }
+
+    for (size_t i = 0; i < g->tile_slots; i++){ //rehash every tile into the bigger index
+        Tile* t = g->tiles[i];
+        if (t != NULL){
+            size_t j = tile_hash(t->tx, t->ty) & (slots - 1);
+            while (tiles[j] != NULL){
+                j = (j + 1) & (slots - 1);
+            }
+            tiles[j] = t;
+        }
+    }
+    free(g->tiles);
+    g->tiles = tiles;
+    g->tile_slots = slots;
+    return true;
+}
+
+//tile a cell coordinate falls in and where in the tile it is. floor_div and not >> or &, which are
+//implementation defined for negative numbers
+long long tile_of(long long v){
+    return floor_div(v, TILE_SIZE);
+}
+
+int tile_offset(long long v){
+    return (int)(v - tile_of(v) * TILE_SIZE);
+}
+
+size_t tile_cell(long long x, long long y){
+    return (size_t)tile_offset(y) * TILE_SIZE + tile_offset(x);
+}
+
+size_t tile_hash(long long tx, long long ty){
+    unsigned long long h = ((unsigned long long)tx * 0x9E3779B97F4A7C15ULL) ^ (unsigned long long)ty;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ULL; //mix the bits so neighbouring tiles spread over the index
+    h ^= h >> 29;
+    return (size_t)h;
+}
+
+//work out which part of the canvas gets written out, 0 by 0 when nothing was drawn on a sparse canvas.
+//returns false if the box around a sparse drawing is too big for an int
+bool output_region(Parser* c, long long* x, long long* y, int* width, int* height){
+    Canvas* g = &c->turtle->grid;
+
+    if (c->options.viewport){ //a requested viewport always wins
+        *x = c->options.view_x;
+        *y = c->options.view_y;
+        *width = c->options.view_width;
+        *height = c->options.view_height;
+        return true;
+    }
+
+    if (g->kind == CANVAS_SPARSE){ //otherwise a sparse canvas writes the box around everything drawn
+        *x = 0;
+        *y = 0;
+        *width = 0;
+        *height = 0;
+        if (g->max_x < g->min_x){
+            return true; //nothing drawn
+        }
+        if ((g->max_x - g->min_x >= INT_MAX) || (g->max_y - g->min_y >= INT_MAX)){
+            return fail(c, TTL_ERR_IO, "drawing is too big to write out, pick a part of it with --viewport!");
+        }
+        *x = g->min_x;
+        *y = g->min_y;
+        *width = g->max_x - g->min_x + 1;
+        *height = g->max_y - g->min_y + 1;
+        return true;
+    }
+
+    *x = 0;
+    *y = 0;
+    *width = g->width;
+    *height = g->height;
+    return true;
+}
+
+void on_error(Parser* c, FILE* fp, FILE* wp, int argc){
+
+    if ((argc <= 1) || (argc > 3)){
+        fprintf(stderr, "invalid number of arguments.\nUsage: ./filename [options] <TTLfile> <outputfile>");
+        exit(EXIT_FAILURE);
+    }
+
+    if (c == NULL){
+        fprintf(stderr, "failed to allocate memory!");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fp == NULL){
+        fprintf(stderr, "failed to locate file!");
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc == 3){
+        if (wp == NULL){ //if file to write to is unable to be found even though there are 3 arguments exit code 1
+            fprintf(stderr, "failed to locate file to write to!");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void parser_free(Parser* c){ //free all dynamically allocated memory
+    free_source(c);
+    free(c->tokens);
+    free(c->program.code);
+    free(c->program.items);
+    free(c->frames);
+    free(c->open);
+    free(c->stack);
+    free(c->screen.shown);
+    free(c->screen.dirty_min);
+    free(c->screen.dirty_max);
+    free(c->screen.row);
+    free(c->screen.runs);
+    free(c->screen.out);
+    free(c->display.segments);
+    free(c->display.slots);
+    if (c->turtle != NULL){
+        canvas_free(&c->turtle->grid);
+    }
+    free(c->turtle);
+    free(c);
+}
+
+//the instruction list is read in one flat loop. a LOOP leaves its index on c->open and the END
+//that closes it is matched here, so nesting and length only use heap memory
+bool prog(Parser* c){
+    c->nopen = 0;
+
+    if (!token_is(c, INSTRUCTION, "START")){ //check that each file begins with a START command
+        return false;
+    }
+    c->cw = c->cw + 1;
+
+    for (;;){
+        if (token_is(c, INSTRUCTION, "END")){
+            if (c->nopen == 0){
+                return true; //the END of the program
+            }
+            if (!close_loop(c)){
+                return false;
+            }
+        }
+        else if (!ins(c)){ //not the end - must be an instruction
+            return false;
+        }
+        c->cw = c->cw + 1; //next letter
+    }
+}
+
+//remember a loop whose body starts after the current token
+bool open_loop(Parser* c, int at){
+    if (c->nopen == c->open_capacity){
+        int capacity = (c->open_capacity == 0) ? PROGRAM_START_SIZE : c->open_capacity * 2;
+        int* open = realloc(c->open, capacity * sizeof(int));
+        if (open == NULL){
+            return fail(c, TTL_ERR_MEMORY, "failed to allocate program memory!");
+        }
+        c->open = open;
+        c->open_capacity = capacity;
+    }
+    c->open[c->nopen++] = at;
+    c->cw = c->cw - 1; //prog steps onto the first instruction of the body
+    return true;
+}
+
+//an END inside a loop, jump the innermost open loop here
+bool close_loop(Parser* c){
+    Code* code = emit(c, OP_END);
+    if (code == NULL){
+        return false;
+    }
+    code->token = c->cw; //the END itself
+    c->nopen--;
+    c->program.code[c->open[c->nopen]].jump = c->program.size - 1; //LOOP jumps to its END when the items run out
+    return true;
+}
+
+bool ins(Parser* c){
+    //check through the list of instructions until a match is found
+    if (fwd(c)){
+        return true;
+    }
+
+    if (rgt(c)){
+        return true;
+    }
+
+    if (loop(c)){
+        return true;
+    }
+    
+    if (col(c)){
+        return true;
+    }
+
+    if (set(c)){
+        return true;
+    }
+
+    if (rectangle(c)){
+        return true;
+    }
+
+    if (triangle(c)){
+        return true;
+    }
+
+    return false;
+}
+
+bool fwd(Parser* c){
+    if (token_is(c, INSTRUCTION, "FORWARD")){
+        c->cw = c->cw + 1;
+        Code* code = emit(c, OP_FORWARD);
+        return ((code != NULL) && operand(c, &code->a)); //distance can be a variable, a number or asked for when the line is drawn
+    }
+    return false;
+}
+
+bool rgt(Parser* c){
+    if (token_is(c, INSTRUCTION, "RIGHT")){
+        c->cw = c->cw + 1;
+        Code* code = emit(c, OP_RIGHT);
+        return ((code != NULL) && operand(c, &code->a));
+    }
+    return false;
+}
+
+bool col(Parser* c){
+    if (token_is(c, INSTRUCTION, "COLOUR")){
+        c->cw = c->cw + 1;
+        Code* code = emit(c, OP_COLOUR);
+        return ((code != NULL) && colour_operand(c, &code->a));
+    }
+    return false;
+}
+
+bool loop(Parser* c) {
+    if (token_is(c, INSTRUCTION, "LOOP")) {
+        c->cw = c->cw + 1;
+
+        if (ltr(TOKEN_TEXT[0])) {
+            int v = find_var(TOKEN_TEXT[0]);
+            if (!validVar(c, v)){
+                return false;
+            }
+            c->cw = c->cw + 1;
+
+            if (token_is(c, INSTRUCTION, "OVER")) { 
+                c->cw = c->cw + 1;
+                int start = c->cw; //save location of the opening brace
+
+                if (!token_is(c, INSTRUCTION, "{")){ //no list, so it has to be a range
+                    return range(c, v);
+                }
+
+                if (!lst(c)) { //parse through the list to check every item in it can be assigned to the loop variable
+                    return fail(c, TTL_ERR_LOOP_ITEMS, "invalid loop items!\n");
+                }
+
+                int at = c->program.size; //index of the LOOP instruction, patched once the body is compiled
+                Code* code = emit(c, OP_LOOP);
+                if ((code == NULL) || !loop_items(c, code, start)){
+                    return false;
+                }
+                code->var = v;
+                return open_loop(c, at); //the body is compiled by prog
+            }
+        }
+    }
+    return false;
+}
+
+//LOOP A OVER 1 .. 100 STEP 5, the ends and step can be numbers or variables and the step is
+//optional. the values are made one at a time as the loop runs instead of being stored
+bool range(Parser* c, int v){
+    Operand from;
+    Operand to;
+    Operand step = {OPERAND_NUM, 1, 0, '\0'};
+
+    if (!range_operand(c, &from)){
+        return false;
+    }
+    c->cw = c->cw + 1;
+    if (!token_is(c, INSTRUCTION, "..")){
+        return fail(c, TTL_ERR_LOOP_ITEMS, "invalid loop items!\n");
+    }
+    c->cw = c->cw + 1;
+    if (!range_operand(c, &to)){
+        return false;
+    }
+    c->cw = c->cw + 1;
+
+    if (token_is(c, INSTRUCTION, "STEP")){
+        c->cw = c->cw + 1;
+        if (!range_operand(c, &step)){
+            return false;
+        }
+        if ((step.kind == OPERAND_NUM) && (step.num == 0)){ //would never finish
+            return fail(c, TTL_ERR_LOOP_ITEMS, "invalid loop step!\n");
+        }
+        c->cw = c->cw + 1;
+    }
+
+    int at = c->program.size;
+    Code* code = emit(c, OP_RANGE);
+    if (code == NULL){
+        return false;
+    }
+    code->var = v;
+    code->a = from;
+    code->b = to;
+    code->step = step;
+    return open_loop(c, at);
+}
+
+//a range end or step has to be there, it is never asked for
+bool range_operand(Parser* c, Operand* o){
+    if ((INSTRUCTION.kind != TOK_NUM) && (INSTRUCTION.kind != TOK_VAR)){
+        return fail(c, TTL_ERR_LOOP_ITEMS, "invalid loop items!\n");
+    }
+    return operand(c, o);
+}
+
+bool rectangle(Parser* c) {
+    if (token_is(c, INSTRUCTION, "RECTANGLE")) {
+        c->cw = c->cw + 1;
+        Code* code = emit(c, OP_RECTANGLE);
+
+        if ((code != NULL) && rectangle_setup(c, code)){
+            return true;
+        }
+    }
+    return false;
+}
+ 
+bool rectangle_setup(Parser* c, Code* code){
+    if (token_is(c, INSTRUCTION, "HEIGHT")){
+        c->cw = c->cw + 1;
+        if (!operand(c, &code->a)){ //check that the number folllowing height is valid and store it as the height
+            return false;
+        }
+        c->cw = c->cw + 1; 
+
+        if (token_is(c, INSTRUCTION, "WIDTH")){
+            c->cw = c->cw + 1; //check width is valid and store it as the width
+            return operand(c, &code->b);
+        }
+    }
+    return false;
+}
+
+void draw_rectangle(Parser* c, double height, double width){
+    turn_to(c->turtle, FWDANGLE); //face turtle upright
+    c->turtle->distance = height; //go up this distance
+    draw_line(c);
+    if (c->watched){
+        print_screen(c); //output to screen if no output file specified
+    }
+
+    turn_to(c->turtle, RGTANGLE); //face turtle right;
+    c->turtle->distance = width;
+    draw_line(c);
+    if (c->watched){
+        print_screen(c);
+    }
+
+
+    turn_to(c->turtle, DWNANGLE); //face turtle down
+    c->turtle->distance = height;
+    draw_line(c);
+    if (c->watched){
+        print_screen(c);
+    }
+
+
+    turn_to(c->turtle, LFTANGLE); //face turtle left
+    c->turtle->distance = width;
+    draw_line(c);
+    if (c->watched){
+        print_screen(c);
+    }
+
+}
+
+bool triangle(Parser* c) {
+    if (token_is(c, INSTRUCTION, "TRIANGLE")) {
+        c->cw = c->cw + 1;
+        Code* code = emit(c, OP_TRIANGLE);
+        return ((code != NULL) && operand(c, &code->a));
+    }
+    return false;
+}
+
+void draw_triangle(Parser* c) {
+    turn_to(c->turtle, FWDANGLE); //set angle to face forward
+    turn_to(c->turtle, c->turtle->angle + (FWDANGLE / 2));//go up 45 degrees
+    draw_line(c);
+    if (c->watched){
+        print_screen(c);
+    }
+
+
+    turn_to(c->turtle, c->turtle->angle + FWDANGLE); //make a 90 degree turn to come back down
+    draw_line(c);
+    if (c->watched){
+        print_screen(c);
+    }
+
+
+    c->turtle->distance++; //extend distance to go back to starting point.
+    turn_to(c->turtle, c->turtle->angle + (FWDANGLE + (FWDANGLE/2))); //go back across to the start 
+    draw_line(c);
+    if (c->watched){
+        print_screen(c);
+    }
+
+
+    c->turtle->distance--;
+}
+ 
+Code* emit(Parser* c, Opcode op){
+    Program* p = &c->program;
+
+    if (p->size == p->capacity){ //double the program whenever it fills up
+        int capacity = (p->capacity == 0) ? PROGRAM_START_SIZE : p->capacity * 2;
+        Code* code = realloc(p->code, capacity * sizeof(Code));
+        if (code == NULL){
+            fail(c, TTL_ERR_MEMORY, "failed to allocate program memory!");
+            return NULL;
+        }
+        p->code = code;
+        p->capacity = capacity;
+    }
+
+    Code* code = &p->code[p->size++];
+    memset(code, 0, sizeof(Code));
+    code->op = op;
+    code->token = c->cw - 1; //the keyword, so run time errors can say where they came from
+    return code;
+}
+
+Item* add_item(Parser* c){
+    Program* p = &c->program;
+
+    if (p->nitems == p->items_capacity){
+        int capacity = (p->items_capacity == 0) ? PROGRAM_START_SIZE : p->items_capacity * 2;
+        Item* items = realloc(p->items, capacity * sizeof(Item));
+        if (items == NULL){
+            fail(c, TTL_ERR_MEMORY, "failed to allocate program memory!");
+            return NULL;
+        }
+        p->items = items;
+        p->items_capacity = capacity;
+    }
+
+    Item* item = &p->items[p->nitems++];
+    memset(item, 0, sizeof(Item));
+    return item;
+}
+
+//decode the items of a loop list, from the token after the opening brace to the closing one.
+//words that aren't colours can never be assigned so they are left out
+bool loop_items(Parser* c, Code* code, int brace){
+    code->item = c->program.nitems;
+
+    for (int t = brace + 1; !token_is(c, c->tokens[t], "}"); t++){
+        Token token = c->tokens[t];
+        ColourCode colour = token_col(c, token);
+
+        if ((token.kind != TOK_VAR) && (token.kind != TOK_NUM) && (colour == '\0')){
+            continue;
+        }
+
+        Item* item = add_item(c);
+        if (item == NULL){
+            return false;
+        }
+        item->token = t;
+
+        if (token.kind == TOK_VAR){
+            item->kind = ITEM_VAR;
+            item->var = find_var(token_text(c, token)[1]);
+            if (!validVar(c, item->var)){
+                return false;
+            }
+        }
+        else if (colour != '\0'){
+            item->kind = ITEM_COL;
+            item->colour = colour;
+        }
+        else {
+            item->kind = ITEM_NUM;
+            item->num = token_num(c, token);
+        }
+        code->nitems++;
+    }
+    return true;
+}
+
+//compile a SET expression, from its first token up to the closing bracket, into postfix items.
+//an operator whose two operands are both numbers is worked out here instead of at run time, and
+//the deepest the expression can push is recorded so running it needs no bounds checks
+bool set_items(Parser* c, Code* code, int from){
+    Program* p = &c->program;
+    int depth = 0;
+    code->item = p->nitems;
+    code->depth = 0;
+
+    for (int t = from; !token_is(c, c->tokens[t], ")"); t++){
+        Token token = c->tokens[t];
+        if ((token.kind != TOK_VAR) && (token.kind != TOK_NUM) && !op(token_text(c, token)[0])){
+            continue; //not part of the expression, the original interpreter stepped over these too
+        }
+        Item* item = add_item(c);
+        if (item == NULL){
+            return false;
+        }
+        item->token = t;
+
+        if (token.kind == TOK_VAR){
+            item->kind = ITEM_VAR;
+            item->var = find_var(token_text(c, token)[1]);
+            if (!validVar(c, item->var)){
+                return false;
+            }
+            depth++; //a variable pushes at most one value
+        }
+        else if (token.kind == TOK_NUM){ //numbers are checked before operators so -5 is a number
+            item->kind = ITEM_NUM;
+            item->num = token_num(c, token);
+            depth++;
+        }
+        else {
+            item->kind = ITEM_OP;
+            item->op = token_text(c, token)[0];
+            depth = (depth > 1) ? depth - 1 : 1; //operands missing here come from the stack left by earlier SETs
+
+            int n = p->nitems - code->item;
+            if ((n >= 3) && (item[-1].kind == ITEM_NUM) && (item[-2].kind == ITEM_NUM) && fold(item[-2].num, item[-1].num, item->op, &item[-2].num)){
+                p->nitems -= 2; //the two numbers and the operator become one number
+                continue;
+            }
+        }
+
+        if (depth > code->depth){
+            code->depth = depth;
+        }
+    }
+    code->nitems = p->nitems - code->item;
+    return true;
+}
+
+//work out a constant operation at compile time, division by zero is left for run time to report
+bool fold(double operand1, double operand2, char operator, double* result){
+    switch (operator){
+        case '+':
+            *result = operand1 + operand2;
+            return true;
+        case '-':
+            *result = operand1 - operand2;
+            return true;
+        case '*':
+            *result = operand1 * operand2;
+            return true;
+        case '/':
+            if ((int)operand2 != 0){
+                *result = operand1 / operand2;
+                return true;
+            }
+    }
+    return false;
+}
+
+bool operand(Parser* c, Operand* o){
+    if (INSTRUCTION.kind == TOK_VAR){ //variables are read when the instruction runs
+        o->kind = OPERAND_VAR;
+        o->var = find_var(TOKEN_TEXT[1]);
+        return validVar(c, o->var);
+    }
+
+    if (INSTRUCTION.kind == TOK_NUM){
+        o->kind = OPERAND_NUM;
+        o->num = token_num(c, INSTRUCTION); //convert once here instead of every time the instruction runs
+        return true;
+    }
+
+    c->cw = c->cw - 1; //go one step back because no value was added
+    o->kind = OPERAND_ASK;
+    return true;
+}
+
+bool colour_operand(Parser* c, Operand* o){
+    if (INSTRUCTION.kind == TOK_VAR){
+        o->kind = OPERAND_VAR;
+        o->var = find_var(TOKEN_TEXT[1]);
+        return validVar(c, o->var);
+    }
+
+    if (INSTRUCTION.kind == TOK_WORD){
+        o->kind = OPERAND_COL;
+        o->colour = token_col(c, INSTRUCTION); //words that aren't a valid colour are stored as null and leave the pen alone
+        return true;
+    }
+
+    c->cw = c->cw - 1;
+    o->kind = OPERAND_ASK;
+    return true;
+}
+
+//execute the compiled program without recursing, loops keep their place on c->frames and END
+//jumps back to the top of the body, so nesting and length only cost heap memory
+void run(Parser* c){
+    int pc = 0;
+    c->nframes = 0;
+
+    while ((pc < c->program.size) && (c->error.status == TTL_OK)){ //stop at the first error
+        if ((c->options.publish != NULL) && (--c->publisher.countdown <= 0)){
+            publish_due(c);
+        }
+        Code* code = &c->program.code[pc];
+        c->cw = code->token;
+
+        switch (code->op){
+            case OP_FORWARD:
+                exec_fwd(c, code);
+                break;
+            case OP_RIGHT:
+                exec_rgt(c, code);
+                break;
+            case OP_COLOUR:
+                exec_col(c, code);
+                break;
+            case OP_SET:
+                exec_set(c, code);
+                break;
+            case OP_RECTANGLE:
+                exec_rectangle(c, code);
+                break;
+            case OP_TRIANGLE:
+                exec_triangle(c, code);
+                break;
+            case OP_LOOP:
+                pc = exec_loop(c, pc);
+                continue;
+            case OP_RANGE:
+                pc = exec_range(c, pc);
+                continue;
+            case OP_END:
+                pc = loop_next(c); //back to the top of the body, or past the END when the loop is done
+                continue;
+        }
+        pc++;
+    }
+}
+
+//find the value of a number operand, returns false if it names a variable that hasn't been set
+bool operand_value(Parser* c, Operand* o, char* keyword, double* value){
+    switch (o->kind){
+        case OPERAND_NUM:
+            *value = o->num;
+            return true;
+        case OPERAND_VAR:
+            if (c->variable[o->var].in_use){
+                *value = c->variable[o->var].value;
+                return true;
+            }
+            return false;
+        case OPERAND_ASK:
+            return ask_value(c, keyword, value); //prompt user input for the missing value
+        case OPERAND_COL:
+            break;
+    }
+    return false;
+}
+
+void exec_fwd(Parser* c, Code* code){
+    double distance;
+
+    if (operand_value(c, &code->a, "FORWARD", &distance)){
+        c->turtle->distance = distance;
+        draw_line(c);
+        if (c->watched){ //if only two arguments have been specified, or a frame log is being kept
+            print_screen(c);
+        }
+    }
+}
+
+void exec_rgt(Parser* c, Code* code){
+    double angle;
+
+    if (operand_value(c, &code->a, "RIGHT", &angle)){
+        turn_to(c->turtle, c->turtle->angle - angle); //subtract from current angle
+    }
+}
+
+void exec_col(Parser* c, Code* code){
+    switch (code->a.kind){
+        case OPERAND_VAR:
+            if (c->variable[code->a.var].in_use){
+                if (c->variable[code->a.var].colour != '\0'){ //if colour isnt null assign the colour to the turtle
+                    c->turtle->colour = c->variable[code->a.var].colour;
+                }
+            }
+            break;
+        case OPERAND_COL:
+            if (code->a.colour != '\0'){ //if a valid colour has been passed in, assign that colour to the turtle's pen
+                c->turtle->colour = code->a.colour;
+            }
+            break;
+        case OPERAND_ASK:
+            ask_colour(c, &c->turtle->colour);
+            break;
+        case OPERAND_NUM:
+            break;
+    }
+}
+
+void exec_set(Parser* c, Code* code){
+    c->variable[code->var].in_use = true;
+    set_interp(c, code); //errors are recorded in c->error and stop the VM
+}
+
+void exec_rectangle(Parser* c, Code* code){
+    double height;
+    double width;
+    double prev_angle = c->turtle->angle;
+
+    if (operand_value(c, &code->a, "HEIGHT", &height) && operand_value(c, &code->b, "WIDTH", &width)){
+        draw_rectangle(c, height, width);
+        turn_to(c->turtle, prev_angle); //reset angle
+    }
+}
+
+void exec_triangle(Parser* c, Code* code){
+    double size;
+    double prev_angle = c->turtle->angle; //save angle
+
+    if (operand_value(c, &code->a, "TRIANGLE", &size)){
+        c->turtle->distance = size;
+        draw_triangle(c);
+        if (code->a.kind == OPERAND_ASK){ //only a size typed in by the user restores the angle the turtle was facing
+            turn_to(c->turtle, prev_angle);
+        }
+    }
+}
+
+//start a list loop, returns where to carry on
+int exec_loop(Parser* c, int pc){
+    Code* code = &c->program.code[pc];
+    c->variable[code->var].in_use = true; //set the loop variable to be in use
+
+    LoopFrame* frame = push_frame(c, pc);
+    if (frame == NULL){
+        return pc;
+    }
+    return loop_next(c);
+}
+
+//start a range loop, the ends and step are read once here. returns where to carry on
+int exec_range(Parser* c, int pc){
+    Code* code = &c->program.code[pc];
+    double from;
+    double to;
+    double step;
+
+    if (!operand_value(c, &code->a, "LOOP", &from) || !operand_value(c, &code->b, "LOOP", &to) ||
+        !operand_value(c, &code->step, "LOOP", &step)){
+        return code->jump + 1; //an unset variable skips the loop like it skips any other instruction
+    }
+    if (step == 0){
+        fail(c, TTL_ERR_LOOP_ITEMS, "invalid loop step!\n");
+        return pc;
+    }
+
+    c->variable[code->var].in_use = true;
+    LoopFrame* frame = push_frame(c, pc);
+    if (frame == NULL){
+        return pc;
+    }
+    frame->from = from;
+    frame->to = to;
+    frame->step = step;
+    return loop_next(c);
+}
+
+//move the innermost loop on to its next item or value, returns the first instruction of the body,
+//or the one after the END once the loop has finished and its frame is popped
+int loop_next(Parser* c){
+    LoopFrame* frame = &c->frames[c->nframes - 1];
+    Code* code = &c->program.code[frame->pc];
+
+    if (code->op == OP_LOOP){
+        Item* items = &c->program.items[code->item];
+        while (frame->next < code->nitems){ //go through all items between the braces of the list
+            if (assign_loop_var(c, code->var, &items[frame->next++])){ //assign the value of the current item in the loop to the loop variable
+                return frame->pc + 1; //run the loop body
+            }
+        }
+    }
+    else {
+        //each value is worked out from the start rather than added up, so long ranges of fractions don't drift
+        double value = frame->from + frame->next * frame->step;
+        if ((frame->step > 0) ? (value <= frame->to) : (value >= frame->to)){
+            Var* var = &c->variable[code->var];
+            var->value = value;
+            var->colour = '\0'; //loop var is a number, cannot be a colour
+            frame->next++;
+            return frame->pc + 1;
+        }
+    }
+
+    c->nframes--;
+    return code->jump + 1;
+}
+
+LoopFrame* push_frame(Parser* c, int pc){
+    if (c->nframes == c->frame_capacity){
+        int capacity = (c->frame_capacity == 0) ? PROGRAM_START_SIZE : c->frame_capacity * 2;
+        LoopFrame* frames = realloc(c->frames, capacity * sizeof(LoopFrame));
+        if (frames == NULL){
+            fail(c, TTL_ERR_MEMORY, "failed to allocate loop memory!");
+            return NULL;
+        }
+        c->frames = frames;
+        c->frame_capacity = capacity;
+    }
+
+    LoopFrame* frame = &c->frames[c->nframes++];
+    memset(frame, 0, sizeof(LoopFrame));
+    frame->pc = pc;
+    return frame;
+}
+
+bool assign_loop_var(Parser* c, int v, Item* item){
+    switch (item->kind){
+        case ITEM_VAR: //if current item is a variable
+            if (!c->variable[item->var].in_use){
+                return false; //nothing to assign, the body is skipped for this item
+            }
+            if (c->variable[item->var].colour != '\0'){
+                c->variable[v].colour = c->variable[item->var].colour;
+                c->variable[v].value = 0; //if loop var is a colour it cannot contain a value as well
+            }
+            else {
+                c->variable[v].value = c->variable[item->var].value;
+                c->variable[v].colour = '\0'; //if loop var is a number it cannot also contain a colour
+            }
+            return true;
+        case ITEM_COL:
+            c->variable[v].colour = item->colour; //assign this colour to the loop variable
+            c->variable[v].value = 0; //loop var is a colour, cannot contain a value
+            return true;
+        case ITEM_NUM:
+            c->variable[v].value = item->num; //set loop var to value of num in item
+            c->variable[v].colour = '\0'; //loop var is a number, cannot be a colour 
+            return true;
+        case ITEM_OP:
+            break;
+    }
+    return false;
+}
+
+bool validword(char* w){
+    return (assign_col(w) != '\0'); //check if word passed into function was one of the valid colours specified in grammar
+}
+
+ColourCode assign_col(char* colour){ //converts a valid colour into a character to be printed on the turtle grid
+    return colour_code(colour, strlen(colour));
+}
+
+ColourCode colour_code(const char* colour, size_t length){
+    const char* validWords[] = {"\"BLACK\"", "\"RED\"", "\"GREEN\"", 
+                                "\"BLUE\"", "\"YELLOW\"", "\"CYAN\"", 
+                                "\"MAGENTA\"", "\"WHITE\"", NULL};
+    const ColourCode codes[] = {'K', 'R', 'G', 'B', 'Y', 'C', 'M', 'W'};
+
+    for (int i = 0; validWords[i] != NULL; i++) {
+        if ((strlen(validWords[i]) == length) && (memcmp(colour, validWords[i], length) == 0)) {
+            return codes[i];
+        }
+    }
+    return '\0';
+}
+
+bool set(Parser* c){
+    if (token_is(c, INSTRUCTION, "SET")){
+        c->cw = c->cw + 1;
+
+        if (ltr(TOKEN_TEXT[0])){
+            int v = find_var(TOKEN_TEXT[0]);
+            if (!validVar(c, v)){
+                return false;
+            }
+            c->cw = c->cw + 1;
+
+            if (token_is(c, INSTRUCTION, "(")){
+                c->cw = c->cw + 1;
+                int previous = c->cw; //record instruction just before parsing the pfix expressions
+
+                if (!pfix(c)){ //parse the set function to check its all valid
+                    return fail(c, TTL_ERR_POSTFIX, "invalid postfix items!\n");
+                }
+                Code* code = emit(c, OP_SET);
+                if ((code == NULL) || !set_items(c, code, previous)){ //decode the expression once for every time the SET runs
+                    return false;
+                }
+                code->var = v;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//process the set expression
+//run a compiled SET expression on registers in this stack frame. values left over by earlier SETs
+//stay on c->stack and are only touched when an operator runs out of its own operands
+bool set_interp(Parser* c, Code* code){
+    double regs[MAX_STACK_SIZE];
+    int sp = 0;
+    Item* items = &c->program.items[code->item];
+    int v = code->var;
+    bool checked = (c->stack->top + 1 + code->depth > MAX_STACK_SIZE); //only then can a push overflow
+
+    for (int i = 0; i < code->nitems; i++){
+        Item* item = &items[i];
+
+        switch (item->kind){
+            case ITEM_VAR: //if item is a variable
+                if (!c->variable[item->var].in_use){
+                    break;
+                }
+                if (c->variable[item->var].colour != '\0'){
+                    c->variable[v].colour = c->variable[item->var].colour; //assign colour straightaway because they should not go on the stack
+                    break;
+                }
+                if (checked && (c->stack->top + 1 + sp >= MAX_STACK_SIZE)){
+                    c->cw = item->token;
+                    return fail(c, TTL_ERR_STACK_OVERFLOW, "Stack overflow!\n");
+                }
+                regs[sp++] = c->variable[item->var].value;
+                break;
+
+            case ITEM_NUM:
+                if (checked && (c->stack->top + 1 + sp >= MAX_STACK_SIZE)){
+                    c->cw = item->token;
+                    return fail(c, TTL_ERR_STACK_OVERFLOW, "Stack overflow!\n");
+                }
+                regs[sp++] = item->num;
+                break;
+
+            case ITEM_COL: //only loop lists hold colours, a SET expression never does
+                break;
+
+            case ITEM_OP: {
+                double operand1;
+                double operand2;
+                c->cw = item->token; //errors point at the operator
+
+                if (sp >= 2){ //the usual case, both operands are in registers
+                    operand2 = regs[--sp];
+                    operand1 = regs[--sp];
+                }
+                else if (sp == 1){
+                    operand2 = regs[--sp];
+                    if (!pop(c, &operand1)){
+                        return false;
+                    }
+                }
+                else if (!pop(c, &operand2) || !pop(c, &operand1)){
+                    return false;
+                }
+
+                if (!apply_operation(c, operand1, operand2, item->op, &regs[sp])){
+                    return false;
+                }
+                sp++;
+                break;
+            }
+        }
+    }
+
+    if (sp == 0){
+        if (!is_stack_empty(c)) { //if stack isnt empty
+            return pop(c, &c->variable[v].value); //pop top of stack into value of variable;
+        }
+        return true;
+    }
+
+    c->variable[v].value = regs[sp - 1]; //top of stack into value of variable
+    for (int i = 0; i < sp - 1; i++){ //anything under it is left for later SETs
+        if (!push(c, regs[i])){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Push an item onto the stack
+bool push(Parser* c, double item) {
+    if (c->stack->top < MAX_STACK_SIZE - 1) {
+        c->stack->items[++c->stack->top] = item; //increment stack pointer first, then set top of stack to new item passed in
+        return true;
+    } 
+    //stack overflow
+    return fail(c, TTL_ERR_STACK_OVERFLOW, "Stack overflow!\n");
+}
+
+// Pop an item from the stack
+bool pop(Parser* c, double* item) {
+    if (!is_stack_empty(c)) {
+        *item = c->stack->items[c->stack->top--]; //return item at top of stack and decrement stack pointer
+        return true;
+    } 
+    //handle stack underflow
+    return fail(c, TTL_ERR_STACK_UNDERFLOW, "Stack underflow!\n");
+}
+
+bool is_stack_empty(Parser* c){
+    return (c->stack->top == EMPTY_STACK); //check if stack pointer is = to empty stack
+}
+
+bool apply_operation(Parser* c, double operand1, double operand2, char operator, double* result){
+    switch (operator) { //perform operation based on operand
+        case '+':
+            *result = operand1 + operand2;
+            return true;
+        case '-':
+            *result = operand1 - operand2;
+            return true;
+        case '*':
+            *result = operand1 * operand2;
+            return true;
+        case '/':
+            if ((int)operand2 != 0) { //
+                *result = operand1 / operand2;
+                return true;
+            } 
+            //if they try to divide by zero
+            return fail(c, TTL_ERR_DIVIDE_BY_ZERO, "Division by zero!\n");
+    }
+    *result = 0; //if invalid operator return 0 (shouldnt ever need to do this because valid operands are checked for twice)
+    return true;
+}
+
+bool num(char* number){
+    char* endptr = NULL;
+    strtod(number, &endptr); //process the instruction 
+
+    if (*endptr != '\0'){ //end pointer should be at the end of the string, if not then an invalid number was inputted
+        return false;
+    }
+
+    return true;
+}
+
+bool ltr(char c){
+    return (isupper(c));
+}
+
+bool pfix(Parser* c){
+    while (!token_is(c, INSTRUCTION, ")")){ //stop at the closing bracket
+        if (INSTRUCTION.kind == TOK_EOF){ //ran out of instructions before the closing brace
+            return false;
+        }
+        c->cw = c->cw + 1; //advance instruction pointer, anything that isn't a variable, number or operator is skipped like it always was
+    }
+    return true;
+}
+
+bool op(char op){ //check that a valid operator is present
+    if (op == '+'){
+        return true;
+    }
+
+     if (op == '-'){
+        return true;
+    }
+
+     if (op == '/'){
+        return true;
+    }
+
+     if (op == '*'){
+        return true;
+    }
+
+    return false;
+}
+
+bool lst(Parser* c) {
+    if (token_is(c, INSTRUCTION, "{")) {
+        c->cw = c->cw + 1; //advance past closing brace
+
+        if (items(c)) { //items returns true as soon as a closing brace is found
+            c->cw = c->cw + 1; //advance past the closing brace
+            return true;
+        }
+    }
+    return false;
+}
+
+bool items(Parser* c){
+    while (!token_is(c, INSTRUCTION, "}")){ //stop at the closing brace of the items list
+        if (INSTRUCTION.kind == TOK_EOF){ //ran out of instructions before the closing brace
+            return false;
+        }
+        if (!item(c)){
+            return false;
+        }
+        c->cw = c->cw + 1;
+    }
+    return true;
+}
+
+bool item(Parser* c){
+    return ((INSTRUCTION.kind == TOK_VAR) || (INSTRUCTION.kind == TOK_NUM) || (INSTRUCTION.kind == TOK_WORD)); //check that an list item is a valid word, number, or variable
+}
+
+void calc_position(Parser* c){
+    if (c->turtle->fixed){
+        calc_position_fixed(c->turtle);
+        return;
+    }
+
+    double new_x = move_position(c->turtle->x, c->turtle->heading_x * (c->turtle->distance)); //heading was worked out when the turtle last turned
+    double new_y = move_position(c->turtle->y, -c->turtle->heading_y * (c->turtle->distance)); 
+    //subtract for y because screen coordinates increase as you go down
+
+    //update positional variables
+    c->turtle->oldX = c->turtle->x;
+    c->turtle->oldY = c->turtle->y; //store the old values of x and y for the line drawing function
+    c->turtle->x = new_x;
+    c->turtle->y = new_y; //assign new position of the turtle
+}
+
+//move a position by a whole number of cells, cut towards zero like the original (int) cast, and stop
+//at MAX_POSITION cells from (0, 0). a move that isn't a number, like an endless distance straight
+//across, leaves it where it is
+double move_position(double position, double move){
+    if (isnan(move)){
+        return position;
+    }
+    return fmin(fmax(position + trunc(move), -MAX_POSITION), MAX_POSITION);
+}
+
+void draw_line(Parser* c){
+    (calc_position(c));
+
+    if (c->options.screen || (c->options.record != NULL)){ //only the terminal and the frame log need to know which cells changed, the frame ring copies whole frames
+        screen_mark(c, c->turtle->oldX, c->turtle->oldY, c->turtle->x, c->turtle->y);
+    }
+
+    if (c->options.display_list && !c->watched){ //drawn all at once when the program has finished
+        if (!display_add(c, c->turtle->oldX, c->turtle->oldY, c->turtle->x, c->turtle->y, c->turtle->colour)){
+            fail(c, TTL_ERR_MEMORY, "failed to allocate display list memory!");
+        }
+        return;
+    }
+
+    draw_segment(c, &c->turtle->grid, c->turtle->oldX, c->turtle->oldY, c->turtle->x, c->turtle->y, c->turtle->colour);
+    if (c->turtle->grid.out_of_memory){ //a sparse canvas couldn't make a tile
+        fail(c, TTL_ERR_MEMORY, "failed to allocate tile memory!");
+    }
+}
+
+//rasterize one line onto the grid with whichever line drawing the options ask for
+void draw_segment(Parser* c, Canvas* g, long long x0, long long y0, long long x1, long long y1, ColourCode colour){
+    if (span_line(g, x0, y0, x1, y1, colour)){
+        //straight across or straight down, both rasterizers plot exactly these cells
+    }
+    else if (c->options.legacy_raster && !c->options.fixed && dda_fits(x0, y0) && dda_fits(x1, y1)){ //fixed point stays integer all the way to the grid
+        draw_line_dda(g, x0, y0, x1, y1, colour);
+    }
+    else {
+        raster_line(g, x0, y0, x1, y1, colour);
+    }
+}
+
+//fast path for horizontal and vertical lines, rows are filled with one memset and columns with a
+//strided loop, both clipped once up front. like the other rasterizers the end point isn't plotted.
+//returns false for any other line
+bool span_line(Canvas* g, long long x0, long long y0, long long x1, long long y1, ColourCode colour){
+    bool across = (y0 == y1);
+    if (!across && (x0 != x1)){
+        return false;
+    }
+
+    long long from = across ? x0 : y0; //cells along the line, the end point is left out
+    long long to = across ? x1 : y1;
+    long long low = (to > from) ? from : to + 1;
+    long long high = (to > from) ? to - 1 : from;
+    long long fixed = across ? y0 : x0; //the coordinate that doesn't change
+
+    if (g->kind == CANVAS_SPARSE){
+        span_sparse(g, across, fixed, low, high, colour);
+        return true;
+    }
+
+    long long fixed_min = across ? g->band_top : 0; //rows are limited to the band being drawn
+    long long fixed_max = across ? g->band_bottom : g->width;
+    long long run_min = across ? 0 : g->band_top;
+    long long run_max = across ? g->width : g->band_bottom;
+    if ((fixed < fixed_min) || (fixed >= fixed_max)){
+        return true; //the whole line is off the grid
+    }
+    if (low < run_min){
+        low = run_min;
+    }
+    if (high >= run_max){
+        high = run_max - 1;
+    }
+    if (low > high){
+        return true;
+    }
+
+    if (across){
+        if (g->packed){
+            packed_fill(g, fixed, low, high, colour);
+            return true;
+        }
+        memset(&CELL(g, low, fixed), colour, high - low + 1);
+        return true;
+    }
+
+    if (g->packed){ //the same half of the same byte on every row
+        unsigned char* cell = (unsigned char*)&PACKED_BYTE(g, fixed, low);
+        int shift = (fixed & 1) * 4;
+        unsigned char keep = ~(0xF << shift);
+        unsigned char code = packed_codes[(unsigned char)colour] << shift;
+        for (long long n = high - low + 1; n > 0; n--){
+            *cell = (*cell & keep) | code;
+            cell += g->stride;
+        }
+        return true;
+    }
+
+    char* cell = &CELL(g, fixed, low);
+    for (long long n = high - low + 1; n > 0; n--){
+        *cell = colour;
+        cell += g->stride;
+    }
+    return true;
+}
+
+//the sparse version works a tile at a time, making tiles as it goes
+void span_sparse(Canvas* g, bool across, long long fixed, long long low, long long high, ColourCode colour){
+    if (low > high){
+        return;
+    }
 
-            if (c->variable[i].in_use){
-                c->turtle->angle -= c->variable[i].value; //subtract value stored at variable
-                return true;
-            }
+    for (long long start = low; start <= high; ){
+        long long end = start - tile_offset(start) + TILE_MASK; //last cell in this tile
+        if (end > high){
+            end = high;
         }
+        long long x = across ? start : fixed;
+        long long y = across ? fixed : start;
 
-        if (num(INSTRUCTION)){
-            c->turtle->angle -= strtod(INSTRUCTION, NULL); //convert string to double, take away from current angle
-            return true;
+        Tile* t = find_tile(g, tile_of(x), tile_of(y), true);
+        if (t == NULL){
+            g->out_of_memory = true; //picked up by draw_line
+            return;
         }
 
+        char* cell = &t->cells[tile_cell(x, y)];
+        if (across){
+            memset(cell, colour, end - start + 1);
+        }
         else {
-            c->cw = c->cw - 1; //go one step back because no value was added
-            ask(INSTRUCTION, answer);
-            c->turtle->angle -= strtod(answer, NULL);
-            return true;
+            for (long long n = end - start + 1; n > 0; n--){
+                *cell = colour;
+                cell += TILE_SIZE;
+            }
         }
+        start = end + 1;
+    }
+
+    //grow the bounding box of everything drawn so far
+    long long min_x = across ? low : fixed;
+    long long max_x = across ? high : fixed;
+    long long min_y = across ? fixed : low;
+    long long max_y = across ? fixed : high;
+    if (min_x < g->min_x){
+        g->min_x = min_x;
+    }
+    if (max_x > g->max_x){
+        g->max_x = max_x;
+    }
+    if (min_y < g->min_y){
+        g->min_y = min_y;
+    }
+    if (max_y > g->max_y){
+        g->max_y = max_y;
     }
-    return false;
 }
 
-bool col(Parser* c){
-    char answer[MAXTOKENSIZE];
-    if (samestr(INSTRUCTION, "COLOUR")){
-        c->cw = c->cw + 1;
+//steps along the line like draw_line_dda but with exact integer maths, point i of the line is at
+//old + i * difference / steps truncated towards zero. draw_line_dda adds up a rounded increment, so
+//where a point lands exactly on a whole cell it can fall just short and plot the cell before, which
+//is why --legacy-raster keeps it for byte for byte identical output. the line is clipped to the grid
+//before anything is plotted so only visible points cost anything
+void raster_line(Canvas* g, long long x0, long long y0, long long x1, long long y1, ColourCode colour){
+    long long dx = x1 - x0;
+    long long dy = y1 - y0;
+    long long steps = (llabs(dx) > llabs(dy)) ? llabs(dx) : llabs(dy);
+    long long first = 0;
+    long long last = steps - 1; //the end point itself is never plotted
+
+    if (steps == 0){
+        return;
+    }
 
-        if (var(INSTRUCTION)){
-            int i = find_var(INSTRUCTION[1]);
-            validVar(i);
-            if (c->variable[i].in_use){
-                if (c->variable[i].colour != '\0'){ //if colour isnt null assign the colour to the turtle
-                    c->turtle->colour = c->variable[i].colour;
-                }
-            }
-             return true; //return true because a valid variable was passed in 
-        }
+    if ((g->kind == CANVAS_DENSE) && 
+        (!clip_axis(x0, dx, steps, g->width, &first, &last) || !clip_axis(y0, dy, steps, g->height, &first, &last))){
+        return; //none of the line is on the grid
+    }
+    if ((g->kind == CANVAS_DENSE) && ((g->band_top > 0) || (g->band_bottom < g->height)) &&
+        !narrow_axis(y0, dy, steps, g->band_top, g->band_bottom, &first, &last)){
+        return; //none of the line is in the band
+    }
 
-        if (word(INSTRUCTION)){
-            if (validword(INSTRUCTION)){ //if a valid colour has been passed in, assign that colour to the turtle's pen
-                c->turtle->colour = assign_col(INSTRUCTION);
-            }
-            return true; //return true because a valid word has been passed in 
+    __int128 px = (__int128)first * dx; //needs more than 64 bits for lines far off the grid
+    __int128 py = (__int128)first * dy;
+    long long qx = floor_div_wide(px, steps); //whole part of first * dx / steps
+    long long rx = px - (__int128)qx * steps; //remainder, always between 0 and steps - 1
+    long long qy = floor_div_wide(py, steps);
+    long long ry = py - (__int128)qy * steps;
+
+    for (long long i = first; i <= last; i++){
+        long long x = x0 + qx; //rounded down
+        long long y = y0 + qy;
+        if ((x < 0) && (rx != 0)){ //negative points truncate towards zero, so round them up instead
+            x++;
         }
-
-        else { 
-            c->cw = c->cw - 1;
-            ask(INSTRUCTION, answer);
-            c->turtle->colour = assign_col(answer);
-            return true;
+        if ((y < 0) && (ry != 0)){
+            y++;
         }
+        canvas_plot(g, x, y, colour);
+        raster_step(&qx, &rx, dx, steps);
+        raster_step(&qy, &ry, dy, steps);
     }
-    return false;
 }
 
-bool loop(Parser* c) {
-    if (samestr(INSTRUCTION, "LOOP")) {
-        c->cw = c->cw + 1;
-
-        if (ltr(INSTRUCTION[0])) {
-            int v = find_var(INSTRUCTION[0]);
-            validVar(v);
-            c->variable[v].in_use = true; //set the loop variable to be in use
+//move q + r / steps on by d / steps, d is never bigger than steps so at most one carry is needed
+void raster_step(long long* q, long long* r, long long d, long long steps){
+    *r += d;
+    if (*r >= steps){
+        *r -= steps;
+        *q += 1;
+    }
+    else if (*r < 0){
+        *r += steps;
+        *q -= 1;
+    }
+}
 
-            c->cw = c->cw + 1;
+//narrow first..last down to the points whose coordinate p0 + i * d / steps truncates to 0..size-1,
+//which is the same as the exact coordinate being strictly between -1 and size
+bool clip_axis(long long p0, long long d, long long steps, long long size, long long* first, long long* last){
+    __int128 low;
+    __int128 high; //i * |d| has to be strictly between these, a coordinate times steps can pass 64 bits
 
-            if (samestr(INSTRUCTION, "OVER")) { 
-                c->cw = c->cw + 1;
-                int start = c->cw; //save location of instruction pointer
+    if (d == 0){
+        return ((p0 > -1) && (p0 < size));
+    }
 
-                if (!lst(c)) { //parse through the list to check every item in it can be assigned to the loop variable
-                fprintf(stderr, "invalid loop items!\n");
-                    exit(EXIT_FAILURE);
-                }
+    if (d > 0){
+        low = -(__int128)(p0 + 1) * steps;
+        high = (__int128)(size - p0) * steps;
+    }
+    else {
+        low = -(__int128)(size - p0) * steps;
+        high = (__int128)(p0 + 1) * steps;
+    }
 
-                c->cw = start; //return instruction pointer to start of the list
-                loopsetup(c, v);
+    __int128 from = floor_div_wide(low, llabs(d)) + 1;
+    __int128 to = -floor_div_wide(-high, llabs(d)) - 1; //ceiling of high / |d|, minus one
 
-                return true;
-            }
-        }
+    if ((from > *last) || (to < *first)){
+        return false; //also keeps from and to inside a long long below
     }
-    return false;
+    if (from > *first){
+        *first = from;
+    }
+    if (to < *last){
+        *last = to;
+    }
+    return (*first <= *last);
 }
 
-bool rectangle(Parser* c) {
-    double height = 0;
-    double width = 0;
-    double prev_angle = c->turtle->angle;
-    if (samestr(INSTRUCTION, "RECTANGLE")) {
-        c->cw = c->cw + 1;
+//narrow first..last down to the points whose coordinate is from low to high - 1. a coordinate only
+//ever moves one way along a line, so those points are all together and binary searches find them
+bool narrow_axis(long long p0, long long d, long long steps, long long low, long long high, long long* first, long long* last){
+    if (d == 0){
+        return ((p0 >= low) && (p0 < high) && (*first <= *last));
+    }
 
-        if (rectangle_setup(c, &height, &width)){
-            draw_rectangle(c, height, width);
-            c->turtle->angle = prev_angle; //reset angle
-            return true;
+    long long from = *first;
+    long long to = *last + 1;
+    while (from < to){ //first point that isn't before the range
+        long long mid = from + (to - from) / 2;
+        long long p = raster_point(p0, d, steps, mid);
+        if ((d > 0) ? (p < low) : (p >= high)){
+            from = mid + 1;
+        }
+        else {
+            to = mid;
         }
     }
-    return false;
-}
- 
-bool rectangle_setup(Parser* c, double* h, double* w){
-    char answer1[MAXTOKENSIZE];
-    char answer2[MAXTOKENSIZE]; //declare the two answer strings
-
-    if (samestr(INSTRUCTION, "HEIGHT")){
-        c->cw = c->cw + 1;
-        
-        if (check_dimensions(c, h, answer1)){ //check that the number folllowing height is valid and pass it into height variable
-            c->cw = c->cw + 1; 
-            if (samestr(INSTRUCTION, "WIDTH")){
-                c->cw = c->cw + 1; //check width is valid and pass into width variable
-                if (check_dimensions(c, w, answer2)){
-                    return true;
-                }
-            }
+    *first = from;
+
+    from = *first;
+    to = *last + 1;
+    while (from < to){ //first point that is past the range
+        long long mid = from + (to - from) / 2;
+        long long p = raster_point(p0, d, steps, mid);
+        if ((d > 0) ? (p >= high) : (p < low)){
+            to = mid;
+        }
+        else {
+            from = mid + 1;
         }
     }
-    return false;
+    *last = from - 1;
+    return (*first <= *last);
 }
 
-bool check_dimensions(Parser* c, double* dimension, char* answer){
-    if (num(INSTRUCTION)){
-        *dimension = strtod(INSTRUCTION, NULL); //if number, set dimension to number
-        return true; 
-    }
-
-    if (var(INSTRUCTION)){
-        int v = find_var(INSTRUCTION[1]);
-        validVar(v);
-        if (c->variable[v].in_use){
-            *dimension = c->variable[v].value; //if var, set dimension to var
-            return true;
-        }
+//coordinate of point i of a line, worked out the same way raster_line steps to it
+long long raster_point(long long p0, long long d, long long steps, long long i){
+    __int128 product = (__int128)i * d;
+    long long q = floor_div_wide(product, steps);
+    long long p = p0 + q;
+    if ((p < 0) && (product - (__int128)q * steps != 0)){
+        p++;
     }
-
-    c->cw = c->cw - 1; //go back a step to see what function we just came from
-    ask(INSTRUCTION, answer); //obtain a response from the user
-    *dimension = strtod(answer, NULL); //store user input into dimension
-    return true;
+    return p;
 }
 
-void draw_rectangle(Parser* c, double height, double width){
-    c->turtle->angle = FWDANGLE; //face turtle upright
-    c->turtle->distance = height; //go up this distance
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c); //output to screen if no output file specified
+long long floor_div(long long a, long long b){ //division rounding down instead of towards zero, b is positive
+    long long q = a / b;
+    if ((a % b != 0) && (a < 0)){
+        q--;
     }
+    return q;
+}
 
-    c->turtle->angle = RGTANGLE; //face turtle right;
-    c->turtle->distance = width;
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c);
+__int128 floor_div_wide(__int128 a, long long b){ //floor_div for the products of the line rasterizer
+    __int128 q = a / b;
+    if ((a % b != 0) && (a < 0)){
+        q--;
     }
+    return q;
+}
 
+//original floating point line drawing, kept for --legacy-raster so old outputs can be reproduced exactly
+void draw_line_dda(Canvas* g, double x0, double y0, double x1, double y1, ColourCode colour){
+    double dx = x1 - x0;
+    double dy = y1 - y0; //calculate difference between the new and old coordinates
 
-    c->turtle->angle = DWNANGLE; //face turtle down
-    c->turtle->distance = height;
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c);
-    }
+    double steps = calc_steps(dy, dx); //calculate the number of steps between the new and old coordinates
+    double xIncrement = dx / steps;
+    double yIncrement = dy / steps; //calculate how much to increment x and y values 
 
+    double x = x0;
+    double y = y0; //set starting positions 
 
-    c->turtle->angle = LFTANGLE; //face turtle left
-    c->turtle->distance = width;
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c);
+    if ((g->kind == CANVAS_DENSE) && ((fmax(x, x1) <= -1) || (fmin(x, x1) >= g->width) ||
+        (fmax(y, y1) <= -1) || (fmin(y, y1) >= g->height))){
+        return; //the whole line is off the grid
     }
 
+    bool drawn = false;
+    for (int i = 0; i < (int)steps; i++){ //cast to int to compare steps to i
+        if (in_grid(g, x, y)){ //check that the values trying to be drawn to are within the grid
+            canvas_plot(g, (int)x, (int)y, colour); //cast to int to plot on grid
+            drawn = true;
+        }
+        else if (drawn){
+            return; //a straight line can't come back onto the grid once it has left it
+        }
+        x += xIncrement;
+        y += yIncrement; //increment x and y values to draw the next point on the line
+    }
 }
 
-bool triangle(Parser* c) {
-    char answer[MAXTOKENSIZE]; //initialise answer string
-    double prev_angle = c->turtle->angle; //save angle
-
-    if (samestr(INSTRUCTION, "TRIANGLE")) {
-        c->cw = c->cw + 1;
-
-        if (num(INSTRUCTION)) {
-            c->turtle->distance = strtod(INSTRUCTION, NULL);
-            draw_triangle(c);
-            return true;
-        }
+//the original stepping counts and plots in int, so a line with an end further out than the original
+//interpreter could reach goes to the integer rasterizer instead
+bool dda_fits(long long x, long long y){
+    return (llabs(x) <= INT_MAX / 2) && (llabs(y) <= INT_MAX / 2);
+}
 
-        if (var(INSTRUCTION)){
-            int v = find_var(INSTRUCTION[1]);
-            validVar(v);
+bool in_grid(Canvas* g, int x, int y){
+    return (check_x(g, x) && check_y(g, y));
+}
 
-            if (c->variable[v].in_use){
-                c->turtle->distance = c->variable[v].value; //restore angle turtle was facing
-                draw_triangle(c);
-                return true;
-            }
-        }
-        
-        else{ //prompt user input for the size of the triangle we need to draw
-            c->cw = c->cw - 1;
-            (ask(INSTRUCTION, answer));
-            c->turtle->distance = strtod(answer, NULL);
-            draw_triangle(c);
-            c->turtle->angle = prev_angle;
-            return true;
-        }
+bool check_x(Canvas* g, int x){
+    if ((g->kind == CANVAS_SPARSE) || ((x >= 0) && (x < g->width))){
+        return true;
     }
     return false;
 }
 
-void draw_triangle(Parser* c) {
-    c->turtle->angle = FWDANGLE; //set angle to face forward
-    c->turtle->angle += (FWDANGLE / 2);//go up 45 degrees
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c);
+bool check_y(Canvas* g, int y){
+    if ((g->kind == CANVAS_SPARSE) || ((y >= g->band_top) && (y < g->band_bottom))){
+        return true;
     }
+    return false;
+}
 
+int calc_steps(int dx, int dy){
+    int steps;
 
-    c->turtle->angle += FWDANGLE; //make a 90 degree turn to come back down
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c);
-    }
-
+    if (abs(dx) > abs(dy)) {
+        steps = abs(dx);
+    } 
 
-    c->turtle->distance++; //extend distance to go back to starting point.
-    c->turtle->angle += FWDANGLE + (FWDANGLE/2); //go back across to the start 
-    draw_line(c);
-    if (c->args == 2){
-        print_screen(c);
+    else {
+        steps = abs(dy);
     }
 
-
-    c->turtle->distance--;
+    return steps;
 }
- 
-void loopsetup(Parser* c, int v){
-    int cnt = 0;
-    c->cw = c->cw + 1;
 
-    if (samestr(INSTRUCTION, "}")){ //if the first item after a closing brace is the opening brace return immediately
-        return; //no need to execute this loop
+//keep a line to draw later, stored relative to where the turtle started so the same list can be
+//drawn on a canvas of any size. when the list fills up duplicates are dropped before it grows,
+//so a program that keeps drawing the same shape doesn't keep using more memory
+bool display_add(Parser* c, long long x0, long long y0, long long x1, long long y1, ColourCode colour){
+    DisplayList* d = &c->display;
+    long long start_x = c->options.width / 2;
+    long long start_y = c->options.height / 2;
+
+    if ((x0 == x1) && (y0 == y1)){
+        return true; //no cells to draw
     }
 
-    while (!(samestr(INSTRUCTION, "}"))){
-        strcpy(c->variable[v].loop.loop_ins[cnt], INSTRUCTION); //store item list into the loop struct for this variable
-        c->cw = c->cw + 1;
-        cnt++; //count how many items there are in the list
+    if (d->size == d->capacity){
+        if (!display_compact(d)){
+            return false;
+        }
+        if ((d->capacity == 0) || (d->size * 2 > d->capacity)){ //still more than half full, so grow
+            size_t capacity = (d->capacity == 0) ? DISPLAY_START_SIZE : d->capacity * 2;
+            Segment* segments = realloc(d->segments, capacity * sizeof(Segment));
+            if (segments == NULL){
+                return false;
+            }
+            d->segments = segments;
+            d->capacity = capacity;
+        }
     }
-    c->cw = c->cw + 1; //advance past the closing brace
 
-    c->variable[v].loop.ins_start = c->cw; //set start of loop to instruction following closing lst brace
-    c->variable[v].loop.instructions = cnt; //cnt is the amount of items in the loop list
+    Segment* s = &d->segments[d->size++];
+    s->x0 = x0 - start_x;
+    s->y0 = y0 - start_y;
+    s->x1 = x1 - start_x;
+    s->y1 = y1 - start_y;
+    s->colour = colour;
+    return true;
+}
 
-    int j = 1;//set j to 1 since we're starting on an instruction
-    
-    while (!samestr(c->instruction[(c->cw + j)], "END")){
-        j++; //count how many instructions there are until loop ends
+//drop every segment that a later segment with the same end points draws over completely. the
+//same end points always plot the same cells, so the later one hides the earlier whatever its
+//colour, and the order of what is left doesn't change
+bool display_compact(DisplayList* d){
+    if (d->size < 2){
+        return true;
     }
-    c->variable[v].loop.ins_end = (c->variable[v].loop.ins_start + j); //end of the loop
-    //now we need to carry out the instructions from ins_start to ins_end
-    //while setting variable [i] to loop->instructions[j] while j >= cnt
-    //this could be done with a for loop and an exec_loop function
-    exec_loop(c, v);
-}
 
-void exec_loop(Parser* c, int v){
-    //go through all loop instructions
-    for (CURRENT_LOOP_INS = 0; CURRENT_LOOP_INS < c->variable[v].loop.instructions; CURRENT_LOOP_INS++){
-        if (assign_loop_var(c, v)){ // assign the value of the current item in the loop to the loop variable
-            c->cw = c->variable[v].loop.ins_start; //set the instruction pointer to the starting instruction of the loop
-            inslst(c);
+    size_t nslots = 1;
+    while (nslots < d->size * 2){ //keep the table at most half full
+        nslots *= 2;
+    }
+    if (nslots > d->nslots){
+        size_t* slots = realloc(d->slots, nslots * sizeof(size_t));
+        if (slots == NULL){
+            return false;
         }
+        d->slots = slots;
+        d->nslots = nslots;
     }
-    c->cw = c->variable[v].loop.ins_end; //at the end of the loop, set the instruction pointer to the 
-}
-
-bool assign_loop_var(Parser* c, int v){
-    if (var(c->variable[v].loop.loop_ins[CURRENT_LOOP_INS])){ //if current item is a variable
-        int item_var = find_var(c->variable[v].loop.loop_ins[CURRENT_LOOP_INS][1]);
-        validVar(item_var);
-        if (c->variable[item_var].in_use){
-            if(c->variable[item_var].colour != '\0'){
-                c->variable[v].colour = c->variable[item_var].colour;
-                c->variable[v].value = 0; //if loop var is a colour it cannot contain a value as well
-                return true;
-            }
-            else {
-                c->variable[v].value = c->variable[item_var].value;
-                c->variable[v].colour = '\0'; //if loop var is a number it cannot also contain a colour
-                return true;
+    memset(d->slots, 0, nslots * sizeof(size_t));
+
+    size_t kept = d->size; //kept segments are packed against the end, newest last
+    for (size_t i = d->size; i-- > 0; ){ //newest first, so the one that is seen first is the one that stays
+        Segment* s = &d->segments[i];
+        size_t j = segment_hash(s) & (nslots - 1);
+        bool hidden = false;
+
+        while (d->slots[j] != 0){
+            Segment* other = &d->segments[d->slots[j] - 1];
+            if ((other->x0 == s->x0) && (other->y0 == s->y0) && (other->x1 == s->x1) && (other->y1 == s->y1)){
+                hidden = true;
+                break;
             }
+            j = (j + 1) & (nslots - 1);
         }
-    }
 
-    if (validword(c->variable[v].loop.loop_ins[CURRENT_LOOP_INS])){ //check if list item is a valid colour 
-        c->variable[v].colour = assign_col(c->variable[v].loop.loop_ins[CURRENT_LOOP_INS]); //if so, assign this colour to the loop variable
-        c->variable[v].value = 0; //loop var is a colour, cannot contain a value
-        return true;
+        if (!hidden){
+            kept--;
+            d->segments[kept] = *s;
+            d->slots[j] = kept + 1;
+        }
     }
 
-    if (num(c->variable[v].loop.loop_ins[CURRENT_LOOP_INS])){
-        c->variable[v].value = strtod(c->variable[v].loop.loop_ins[CURRENT_LOOP_INS], NULL); //set loop var to value of num in item
-        c->variable[v].colour = '\0'; //loop var is a number, cannot be a colour 
-        return true;
-    }
+    d->size -= kept;
+    memmove(d->segments, &d->segments[kept], d->size * sizeof(Segment));
+    return true;
+}
 
-    return false;
+size_t segment_hash(Segment* s){
+    return tile_hash((long long)tile_hash(s->x0, s->y0) ^ s->x1, s->y1); //reuse the tile mixing on all four ends
 }
 
-bool validword(char* w){
-    const char* validWords[] = {"\"BLACK\"", "\"RED\"", "\"GREEN\"", 
-                                "\"BLUE\"", "\"YELLOW\"", "\"CYAN\"", 
-                                "\"MAGENTA\"", "\"WHITE\"", NULL};
+//draw the whole display list in the order it was recorded, around the start of the current canvas
+void display_render(Parser* c){
+    DisplayList* d = &c->display;
+    long long start_x = c->options.width / 2;
+    long long start_y = c->options.height / 2;
 
-    for (int i = 0; validWords[i] != NULL; i++) {
-        if (samestr(w, validWords[i])) { //check if word passed into function was one of the valid colours specified in grammar
-            return true;
+    if (!display_compact(d)){
+        fail(c, TTL_ERR_MEMORY, "failed to allocate display list memory!");
+        return;
+    }
+    c->stats.segments = d->size;
+
+    Canvas* g = &c->turtle->grid;
+    bool threaded = (g->kind == CANVAS_DENSE) && (c->options.raster_threads > 1) && (d->size > 0);
+    if (!threaded || !display_render_bands(c)){ //one thread, or no memory for the bins
+        for (size_t i = 0; i < d->size; i++){
+            Segment* s = &d->segments[i];
+            draw_segment(c, g, s->x0 + start_x, s->y0 + start_y, s->x1 + start_x, s->y1 + start_y, s->colour);
         }
     }
-    return false;
-}
 
-ColourCode assign_col(char* colour){ //converts a valid colour into a character to be printed on the turtle grid
-    if (samestr(colour, "\"BLACK\"")) {
-        return 'K';
-    } 
-    if (samestr(colour, "\"RED\"")) {
-        return 'R';
-    }
-    if (samestr(colour, "\"GREEN\"")) {
-        return 'G';
-    }
-    if (samestr(colour, "\"BLUE\"")) {
-        return 'B';
-    }
-    if (samestr(colour, "\"YELLOW\"")) {
-        return 'Y';
-    }
-    if (samestr(colour, "\"CYAN\"")) {
-        return 'C';
-    }
-    if (samestr(colour, "\"MAGENTA\"")) {
-        return 'M';
-    }
-    if (samestr(colour, "\"WHITE\"")) {
-        return 'W';
-    }
-    else {
-        return '\0';
+    if (c->turtle->grid.out_of_memory){
+        fail(c, TTL_ERR_MEMORY, "failed to allocate tile memory!");
     }
 }
 
-bool set(Parser* c){
-    if (samestr(INSTRUCTION, "SET")){
-        c->cw = c->cw + 1;
-
-        if (ltr(INSTRUCTION[0])){
-            int v = find_var(INSTRUCTION[0]);
-            validVar(v);
-            c->variable[v].in_use = true;
-            c->cw = c->cw + 1;
-
-            if (samestr(INSTRUCTION, "(")){
-                c->cw = c->cw + 1;
-                int previous = c->cw; //record instruction just before parsing the pfix expressions
+//draw the display list on several threads at once. the grid is split into bands of rows and every
+//segment is binned into each band it could reach, in sequence order. a band is only ever drawn by
+//one thread, which draws its segments in that order clipped to the band, so each cell still ends
+//up the colour of the last segment over it. only dense canvases, tiles can't be made in parallel
+bool display_render_bands(Parser* c){
+    DisplayList* d = &c->display;
+    Canvas* g = &c->turtle->grid;
+    long long start_x = c->options.width / 2;
+    long long start_y = c->options.height / 2;
+    RasterBands rb;
+
+    rb.engine = c;
+    rb.nbands = (g->height + RASTER_BAND_ROWS - 1) / RASTER_BAND_ROWS;
+    rb.next = 0;
+    rb.starts = calloc(rb.nbands + 1, sizeof(size_t));
+    if (rb.starts == NULL){
+        return false;
+    }
 
-                if (!pfix(c)){ 
-                    fprintf(stderr, "invalid postfix items!\n");
-                    exit(EXIT_FAILURE); //parse the set function to check its all valid
-                }
-                c->cw = previous; //set instruction pointer to start of expression
-                set_interp(c, v);
-                return true;
+    for (int pass = 0; pass < 2; pass++){ //count how much each band gets, then fill the bins
+        if (pass == 1){
+            for (int b = 0; b < rb.nbands; b++){ //turn the counts into where each band starts
+                rb.starts[b + 1] += rb.starts[b];
+            }
+            rb.bins = malloc((rb.starts[rb.nbands] + 1) * sizeof(size_t));
+            if (rb.bins == NULL){
+                free(rb.starts);
+                return false;
             }
         }
-    }
-    return false;
-}
 
-//process the set expression
-void set_interp(Parser* c, int v){
-    while (!samestr(INSTRUCTION, ")")){
-
-        if (var(INSTRUCTION)){ //if item is a variable
-            int i = find_var(INSTRUCTION[1]);
-            validVar(i);
-            if (c->variable[i].in_use){
-                if (c->variable[i].colour != '\0'){
-                    c->variable[v].colour = c->variable[i].colour; //assign colour straightaway because they should not go on the stack
+        for (size_t i = 0; i < d->size; i++){
+            Segment* s = &d->segments[i];
+            long long top = ((s->y0 < s->y1) ? s->y0 : s->y1) + start_y - 1; //a row of slack for the legacy rounding
+            long long bottom = ((s->y0 > s->y1) ? s->y0 : s->y1) + start_y + 1;
+            long long left = ((s->x0 < s->x1) ? s->x0 : s->x1) + start_x - 1;
+            long long right = ((s->x0 > s->x1) ? s->x0 : s->x1) + start_x + 1;
+            if ((bottom < 0) || (top >= g->height) || (right < 0) || (left >= g->width)){
+                continue; //nowhere near the grid
+            }
+
+            int first = (top < 0) ? 0 : (int)(top / RASTER_BAND_ROWS);
+            int last = (bottom >= g->height) ? rb.nbands - 1 : (int)(bottom / RASTER_BAND_ROWS);
+            for (int b = first; b <= last; b++){
+                if (pass == 0){
+                    rb.starts[b + 1]++;
                 }
                 else {
-                    push(c, c->variable[i].value); //push variable value onto the stack
+                    rb.bins[rb.starts[b]++] = i; //starts[b] walks to the start of the next band
                 }
             }
         }
+    }
+    for (int b = rb.nbands; b > 0; b--){ //put back the starts the fill moved on
+        rb.starts[b] = rb.starts[b - 1];
+    }
+    rb.starts[0] = 0;
 
-        if (num(INSTRUCTION)){ //if postfix item is a number
-            double operand = strtod(INSTRUCTION, NULL); //convert string to double
-            push(c, operand); //push the number onto the stack
-        }
+    int nthreads = (c->options.raster_threads < rb.nbands) ? c->options.raster_threads : rb.nbands;
+    pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+    pthread_mutex_init(&rb.lock, NULL);
 
-        if (op(INSTRUCTION[0])){
-            char operator = INSTRUCTION[0];
-            double operand2 = pop(c); //pop top two values of stack
-            double operand1 = pop(c);
-            double item = apply_operation(operand1, operand2, operator); //apply the operation
-            push (c, item); //push result of operation back onto the stack
+    int started = 0;
+    for (int t = 1; (threads != NULL) && (t < nthreads); t++){
+        if (pthread_create(&threads[t], NULL, raster_worker, &rb) != 0){
+            break; //carry on with fewer threads, the others take the spare bands
         }
-        c->cw = c->cw + 1; //advance instruction pointer;
+        started = t;
     }
-    if (!is_stack_empty(c)) { //if stack isnt empty
-        c->variable[v].value = pop(c); //pop top of stack into value of variable;
+    raster_worker(&rb); //the calling thread draws bands too
+    for (int t = 1; t <= started; t++){
+        pthread_join(threads[t], NULL);
     }
+
+    pthread_mutex_destroy(&rb.lock);
+    free(threads);
+    free(rb.bins);
+    free(rb.starts);
+    return true;
 }
 
-// Push an item onto the stack
-void push(Parser* c, double item) {
-    if (c->stack->top < MAX_STACK_SIZE - 1) {
-        c->stack->items[++c->stack->top] = item; //increment stack pointer first, then set top of stack to new item passed in
-    } 
-    else {
-        //stack overflow
-        fprintf(stderr, "Stack overflow!\n");
-        exit(EXIT_FAILURE);
+void* raster_worker(void* arg){
+    RasterBands* rb = arg;
+    Parser* c = rb->engine;
+    DisplayList* d = &c->display;
+    long long start_x = c->options.width / 2;
+    long long start_y = c->options.height / 2;
+
+    while (true){
+        pthread_mutex_lock(&rb->lock);
+        int b = rb->next++;
+        pthread_mutex_unlock(&rb->lock);
+        if (b >= rb->nbands){
+            return NULL;
+        }
+
+        Canvas band = c->turtle->grid; //same cells, drawing limited to this band's rows
+        band.band_top = b * RASTER_BAND_ROWS;
+        band.band_bottom = (band.band_top + RASTER_BAND_ROWS < band.height) ? band.band_top + RASTER_BAND_ROWS : band.height;
+
+        for (size_t k = rb->starts[b]; k < rb->starts[b + 1]; k++){
+            Segment* s = &d->segments[rb->bins[k]];
+            draw_segment(c, &band, s->x0 + start_x, s->y0 + start_y, s->x1 + start_x, s->y1 + start_y, s->colour);
+        }
     }
 }
 
-// Pop an item from the stack
-double pop(Parser* c) {
-    if (!is_stack_empty(c)) {
-        return c->stack->items[c->stack->top--]; //return item at top of stack and decrement stack pointer
-    } 
-    else {
-        //handle stack underflow
-        fprintf(stderr, "Stack underflow!\n");
-        exit(EXIT_FAILURE);
+//draw the display list of the last run with 1, 2, 4 ... up to most threads and print how long each
+//took, the grid is left as the last one drew it
+void raster_bench(Parser* c, int most){
+    TTLOptions options = c->options;
+    TTLError error;
+    double one = 0;
+
+    for (int t = 1; ; t = (t * 2 > most) ? most : t * 2){
+        struct timespec start;
+        options.raster_threads = t;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (ttl_engine_redraw(c, &options, &error) != TTL_OK){
+            fprintf(stderr, "%s", error.message);
+            return;
+        }
+        double seconds = elapsed(start);
+        if (t == 1){
+            one = seconds;
+        }
+        fprintf(stderr, "%d raster threads: %.6f s, %.2fx\n", t, seconds, (seconds > 0) ? one / seconds : 0);
+        if (t == most){
+            return;
+        }
     }
 }
 
-bool is_stack_empty(Parser* c){
-    return (c->stack->top == EMPTY_STACK); //check if stack pointer is = to empty stack
-}
+//the grid is copied into a buffer a chunk of rows at a time and written with one fwrite per chunk
+bool print_grid(Parser* c, FILE* wp){
+    Canvas* g = &c->turtle->grid;
+    long long x;
+    long long y;
+    int width;
+    int height;
 
-double apply_operation(double operand1, double operand2, char operator){
-    switch (operator) { //perform operation based on operand
-        case '+':
-            return operand1 + operand2;
-        case '-':
-            return operand1 - operand2;
-        case '*':
-            return operand1 * operand2;
-        case '/':
-            if ((int)operand2 != 0) { //
-                return operand1 / operand2;
-            } 
-            else {
-                //if they try to divide by zero
-                fprintf(stderr, "Division by zero!\n");
-                exit(EXIT_FAILURE);
-            }
+    if (!output_region(c, &x, &y, &width, &height)){
+        return false;
+    }
+    if (width == 0){ //nothing drawn on a sparse canvas, write the empty grid a dense one would have
+        width = g->width;
+        height = g->height;
     }
-    return 0; //if invalid operator return 0 (shouldnt ever need to do this because valid operands are checked for twice)
+
+    if (c->options.format == TTL_FORMAT_RLE){
+        return print_grid_rle(c, wp, x, y, width, height);
+    }
+    if ((c->options.format == TTL_FORMAT_PPM) || (c->options.format == TTL_FORMAT_PAM)){
+        return print_grid_image(c, wp, x, y, width, height);
+    }
+
+    if (c->options.mmap_output && print_grid_mmap(c, wp, x, y, width, height)){
+        return true;
+    }
+
+    size_t line = (size_t)width + 1; //every row ends in a newline
+    int rows = OUTPUT_CHUNK / line;
+    if (rows < 1){
+        rows = 1;
+    }
+    if (rows > height){
+        rows = height;
+    }
+
+    char* buffer = malloc(line * rows);
+    if (buffer == NULL){
+        return fail(c, TTL_ERR_MEMORY, "failed to allocate output memory!");
+    }
+
+    for (int row = 0; row < height; row += rows){
+        int n = (height - row < rows) ? (height - row) : rows;
+        fill_rows(g, buffer, x, y + row, width, n);
+        if (fwrite(buffer, line, n, wp) != (size_t)n){
+            free(buffer);
+            return fail(c, TTL_ERR_IO, "failed to write to output file!");
+        }
+    }
+    free(buffer);
+    return true;
 }
 
-bool num(char* number){
-    char* endptr = NULL;
-    strtod(number, &endptr); //process the instruction 
+//size the output file to fit the grid and write the rows straight into a shared mapping of it,
+//returns false if the file can't be mapped (a pipe or a terminal) so the caller writes it normally
+bool print_grid_mmap(Parser* c, FILE* wp, long long x, long long y, int width, int height){
+    struct stat st;
+    int fd = fileno(wp);
+    size_t size = ((size_t)width + 1) * height;
+
+    fflush(wp);
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (ftruncate(fd, size) != 0)){
+        return false;
+    }
 
-    if (*endptr != '\0'){ //end pointer should be at the end of the string, if not then an invalid number was inputted
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED){
         return false;
     }
 
+    fill_rows(&c->turtle->grid, map, x, y, width, height);
+    munmap(map, size);
+    fseek(wp, 0, SEEK_END); //anything else written to the file goes after the grid
     return true;
 }
 
-bool var(char* variable){
-
-    if ((variable[0] == '$') && (strlen(variable) == 2)){ //check that the only thing in this string is the $ and a letter
-        if (ltr(variable[1])){ 
-            return true;
-        }
+//write the grid as TTLRLE: a "TTLRLE width height" line then one line per row. a row is runs of
+//a count and a colour letter, with . for empty cells, the count left out when it is 1 and the
+//empty cells at the end of the row left out. a line "+n" repeats the row before it n more times,
+//and the row before the first row counts as empty, so blank space costs almost nothing
+bool print_grid_rle(Parser* c, FILE* wp, long long x, long long y, int width, int height){
+    TTLStatus status = TTL_ERR_IO;
+    if (fprintf(wp, "TTLRLE %d %d\n", width, height) > 0){
+        status = rle_rows(&c->turtle->grid, wp, x, y, width, height);
     }
 
-    return false;
+    if (status == TTL_ERR_MEMORY){
+        return fail(c, TTL_ERR_MEMORY, "failed to allocate output memory!");
+    }
+    if (status != TTL_OK){
+        return fail(c, TTL_ERR_IO, "failed to write to output file!");
+    }
+    return true;
 }
 
-bool ltr(char c){
-    return (isupper(c));
-}
+//write rows of the canvas as TTLRLE rows, also used for the keyframes of a frame log
+TTLStatus rle_rows(Canvas* g, FILE* wp, long long x, long long y, int width, int height){
+    char* cells = malloc((size_t)width * 2);
+    char* line = malloc((size_t)width * RLE_RUN_SIZE + 1); //the longest row is every cell a different colour
+    if ((cells == NULL) || (line == NULL)){
+        free(cells);
+        free(line);
+        return TTL_ERR_MEMORY;
+    }
+
+    char* row = cells; //this row and the row before it take turns in the two halves of cells
+    char* before = cells + width;
+    memset(before, '\0', width);
+    long long repeats = 0;
+    bool written = true;
+
+    for (int r = 0; (r < height) && written; r++){
+        canvas_row(g, x, y + r, width, row);
+        if (memcmp(row, before, width) == 0){
+            repeats++;
+            continue;
+        }
+
+        if (repeats > 0){
+            written = (fprintf(wp, "+%lld\n", repeats) > 0);
+            repeats = 0;
+        }
+        size_t size = rle_row(row, width, line);
+        written = written && (fwrite(line, 1, size, wp) == size);
+
+        char* swap = before;
+        before = row;
+        row = swap;
+    }
+    if (written && (repeats > 0)){
+        written = (fprintf(wp, "+%lld\n", repeats) > 0);
+    }
 
-bool varnum(char* instruction){
-    return (var(instruction) || num(instruction)); //pass string into both var and num functions
+    free(cells);
+    free(line);
+    return written ? TTL_OK : TTL_ERR_IO;
 }
 
-bool word(char* instruction) {
+//encode one row of cells into out as runs ending in a newline, returns how many bytes were written
+size_t rle_row(const char* cells, int width, char* out){
+    int end = width;
+    while ((end > 0) && (cells[end - 1] == '\0')){ //trailing empty cells aren't written
+        end--;
+    }
 
-    int length = strlen(instruction);
+    size_t size = 0;
+    for (int col = 0; col < end; ){
+        int run = col + 1;
+        if (cells[col] == '\0'){
+            run = col + empty_run(cells + col, end - col); //gaps are usually long, skip them a word at a time
+        }
+        else {
+            while ((run < end) && (cells[run] == cells[col])){
+                run++;
+            }
+        }
 
-    if (instruction[0] == '\"'){
-        if (instruction[length - 1] == '\"'){ //if the word starts and ends with double quotations it is a valid word under the grammar
-            return true;
+        if (run - col > 1){
+            size += snprintf(out + size, RLE_RUN_SIZE, "%d", run - col);
         }
+        out[size++] = (cells[col] == '\0') ? '.' : cells[col];
+        col = run;
     }
+    out[size++] = '\n';
+    return size;
+}
 
-    return false;
+//how many null cells cells starts with, checking eight at a time while it can
+int empty_run(const char* cells, int n){
+    int i = 0;
+    for (; i + (int)sizeof(uint64_t) <= n; i += sizeof(uint64_t)){
+        uint64_t w;
+        memcpy(&w, cells + i, sizeof(w));
+        if (w != 0){
+            break;
+        }
+    }
+    while ((i < n) && (cells[i] == '\0')){
+        i++;
+    }
+    return i;
 }
 
-bool pfix(Parser* c){
-    if (samestr(INSTRUCTION, ")")){ //base case is the ending closing brace
-        return true;
+//read a TTLRLE file and write the same grid as text, exactly what print_grid would have written
+bool rle_to_text(FILE* in, FILE* out){
+    int width;
+    int height;
+    if ((fscanf(in, "TTLRLE %d %d", &width, &height) != 2) || (width < 1) || (height < 1) || (fgetc(in) != '\n')){
+        fprintf(stderr, "not a TTLRLE file!");
+        return false;
     }
 
-    if (op(INSTRUCTION[0])){
-        c->cw = c->cw + 1;
-        if (!pfix(c)){ //advance instruction pointer and recursively go through the function 
-            return false;
-        }
+    char* row = malloc((size_t)width + 1);
+    char* line = NULL;
+    size_t capacity = 0;
+    if (row == NULL){
+        fprintf(stderr, "failed to allocate memory!");
+        return false;
     }
+    memset(row, ' ', width); //the row before the first one is empty
+    row[width] = '\n';
+
+    bool ok = true;
+    int rows = 0;
+    ssize_t length;
+    while (ok && ((length = getline(&line, &capacity, in)) > 0)){
+        if (line[length - 1] == '\n'){
+            line[--length] = '\0';
+        }
 
-    if (varnum(INSTRUCTION)){
-        c->cw = c->cw + 1;
-        if (!pfix(c)){
-            return false; 
+        long long repeats = 1; //a row of runs is written once
+        if (line[0] == '+'){
+            char* end;
+            repeats = strtoll(line + 1, &end, 10);
+            ok = (*end == '\0') && (repeats > 0) && (repeats <= height - rows);
+        }
+        else {
+            ok = (rle_decode(line, row, width, ' ', true) >= 0);
+        }
+
+        for (long long r = 0; ok && (r < repeats); r++){
+            ok = (fwrite(row, 1, (size_t)width + 1, out) == (size_t)width + 1);
+            rows++;
         }
     }
+    ok = ok && (rows == height);
 
-    return true;
+    if (!ok){
+        fprintf(stderr, "invalid TTLRLE file!");
+    }
+    free(row);
+    free(line);
+    return ok;
 }
 
-bool op(char op){ //check that a valid operator is present
-    if (op == '+'){
-        return true;
+//write the grid as a binary ppm (P6) or pam (P7 with alpha), each cell scale pixels across and down.
+//rows are streamed one at a time, a scaled row is built once and written scale times, so the
+//image as a whole is never held in memory
+bool print_grid_image(Parser* c, FILE* wp, long long x, long long y, int width, int height){
+    Canvas* g = &c->turtle->grid;
+    bool alpha = (c->options.format == TTL_FORMAT_PAM);
+    int channels = alpha ? 4 : 3;
+    int scale = (c->options.scale > 1) ? c->options.scale : 1;
+    long long columns = (long long)width * scale;
+    long long rows = (long long)height * scale;
+    size_t line = (size_t)columns * channels;
+
+    if ((columns > INT_MAX) || (rows > INT_MAX)){
+        return fail(c, TTL_ERR_IO, "image is too big to write!");
     }
 
-     if (op == '-'){
-        return true;
+    char* cells = malloc(width);
+    unsigned char* pixels = malloc(line);
+    if ((cells == NULL) || (pixels == NULL)){
+        free(cells);
+        free(pixels);
+        return fail(c, TTL_ERR_MEMORY, "failed to allocate output memory!");
     }
 
-     if (op == '/'){
-        return true;
+    bool written;
+    if (alpha){
+        written = (fprintf(wp, "P7\nWIDTH %lld\nHEIGHT %lld\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", columns, rows) > 0);
     }
-
-     if (op == '*'){
-        return true;
+    else {
+        written = (fprintf(wp, "P6\n%lld %lld\n255\n", columns, rows) > 0);
     }
 
-    return false;
-}
+    for (int r = 0; (r < height) && written; r++){
+        canvas_row(g, x, y + r, width, cells);
 
-bool lst(Parser* c) {
-    if (samestr(c->instruction[c->cw], "{")) {
-        c->cw = c->cw + 1; //advance past closing brace
+        unsigned char* p = pixels;
+        for (int col = 0; col < width; col++){
+            const unsigned char* colour = palette[packed_codes[(unsigned char)cells[col]]];
+            for (int s = 0; s < scale; s++){
+                memcpy(p, colour, channels); //ppm takes the first three, red green blue
+                p += channels;
+            }
+        }
 
-        if (items(c)) { //items returns true as soon as a closing brace is found
-            c->cw = c->cw + 1; //advance past the closing brace
-            return true;
+        for (int s = 0; (s < scale) && written; s++){
+            written = (fwrite(pixels, 1, line, wp) == line);
         }
     }
-    return false;
+
+    free(cells);
+    free(pixels);
+    if (!written){
+        return fail(c, TTL_ERR_IO, "failed to write to output file!");
+    }
+    return true;
 }
 
-bool items(Parser* c){
-    if (samestr(c->instruction[c->cw], "}")) { //base case = if a closing brace for the items list is found
-        return true; 
+const char* format_extension(TTLFormat format){
+    switch (format){
+        case TTL_FORMAT_RLE:
+            return "rle";
+        case TTL_FORMAT_PPM:
+            return "ppm";
+        case TTL_FORMAT_PAM:
+            return "pam";
+        default:
+            return "txt";
     }
+}
 
-    if (!item(c)){
-        return false;
+//copy rows of the canvas starting at x, y into dst with no newlines, empty cells stay null
+void fill_cells(Canvas* g, char* dst, long long x, long long y, int width, int height){
+    for (int row = 0; row < height; row++){
+        canvas_row(g, x, y + row, width, dst + (size_t)row * width);
     }
+}
 
-    c->cw = c->cw + 1;
-    return items(c); // Keep caling items recursively
+//write rows of the canvas starting at x, y into dst as text lines, empty cells become spaces
+void fill_rows(Canvas* g, char* dst, long long x, long long y, int width, int rows){
+    size_t line = (size_t)width + 1;
+
+    for (int row = 0; row < rows; row++){
+        canvas_row(g, x, y + row, width, dst + row * line);
+        dst[row * line + width] = '\n';
+    }
+    blank_cells(dst, line * rows);
 }
 
-bool item(Parser* c){
-    return ((varnum(INSTRUCTION)) || (word(INSTRUCTION))); //check that an list item is a valid word, number, or variable
+//copy width cells of row y starting at column x into dst, cells off the canvas are null
+void canvas_row(Canvas* g, long long x, long long y, int width, char* dst){
+    if (g->kind == CANVAS_DENSE){
+        memset(dst, '\0', width);
+        if ((y < 0) || (y >= g->height) || (x >= g->width) || (x + width <= 0)){
+            return;
+        }
+        long long from = (x < 0) ? 0 : x; //part of the row that is on the grid
+        long long to = (x + width > g->width) ? g->width : x + width;
+        if (g->packed){
+            packed_row(g, from, y, to - from, dst + (from - x));
+            return;
+        }
+        memcpy(dst + (from - x), &CELL(g, from, y), to - from);
+        return;
+    }
+
+    int col = 0;
+    while (col < width){ //copy a tile's worth of the row at a time
+        long long cx = x + col;
+        int n = TILE_SIZE - tile_offset(cx);
+        if (n > width - col){
+            n = width - col;
+        }
+
+        Tile* t = find_tile(g, tile_of(cx), tile_of(y), false);
+        if (t == NULL){
+            memset(dst + col, '\0', n);
+        }
+        else {
+            memcpy(dst + col, &t->cells[tile_cell(cx, y)], n);
+        }
+        col += n;
+    }
 }
 
-void calc_position(Parser* c){
-    double angleRadians = c->turtle->angle * (M_PI / 180.0); //convert angle to radians to use cos and sin functions
+//turn every null character into a space, eight bytes at a time
+void blank_cells(char* cells, size_t size){
+    const uint64_t low = 0x7F7F7F7F7F7F7F7FULL;
+    const uint64_t high = 0x8080808080808080ULL;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)){
+        uint64_t w;
+        memcpy(&w, cells + i, sizeof(w));
+        uint64_t zero = ~(((w & low) + low) | w) & high; //top bit set in every byte that was zero
+        w |= zero >> 2; //0x80 >> 2 is a space
+        memcpy(cells + i, &w, sizeof(w));
+    }
 
-    int new_x = c->turtle->x + ((int) (cos(angleRadians) * (c->turtle->distance)));
-    int new_y = c->turtle->y - ((int) (sin(angleRadians) * (c->turtle->distance))); 
-    //subtract for y because screen coordinates increase as you go down
+    for (; i < size; i++){
+        if (cells[i] == '\0'){
+            cells[i] = ' ';
+        }
+    }
+}
 
-    //update positional variables
-    c->turtle->oldX = c->turtle->x;
-    c->turtle->oldY = c->turtle->y; //store the old values of x and y for the line drawing function
-    c->turtle->x = new_x;
-    c->turtle->y = new_y; //assign new position of the turtle
+int find_var(char var){
+    int i = var - 'A';
+    if ((i >= 0) && (i < 26)){ //check that variable is an uppercase letter
+        return i;
+    }
+    return INVALID_VAR;
 }
 
-void draw_line(Parser* c){
-    (calc_position(c));
-    double dx = c->turtle->x - c->turtle->oldX;
-    double dy = c->turtle->y - c->turtle->oldY; //calculate difference between the new and old coordinates
+//called after every line drawn in terminal mode. lines drawn less than a frame apart are merged
+//into the next frame, and the pause between lines sleeps instead of spinning
+void print_screen(Parser* c){
+    Screen* sc = &c->screen;
+    if ((c->options.record != NULL) || (c->options.publish != NULL)){ //no terminal, so nothing to wait for
+        if (c->options.record != NULL){
+            record_frame(c); //every line is a frame of the log
+        }
+        if (c->options.publish != NULL){
+            c->publisher.pending = true; //published by publish_due when a frame is due
+        }
+        return;
+    }
 
-    double steps = calc_steps(dy, dx); //calculate the number of steps between the new and old coordinates
-    double xIncrement = dx / steps;
-    double yIncrement = dy / steps; //calculate how much to increment x and y values 
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    double x = c->turtle->oldX;
-    double y = c->turtle->oldY; //set starting positions 
+    double since = (now.tv_sec - sc->last_frame.tv_sec) + (now.tv_nsec - sc->last_frame.tv_nsec) / 1e9;
+    if (!sc->started || (since >= 1.0 / sc->fps)){
+        screen_present(c);
+        sc->last_frame = now;
+    }
 
-    for (int i = 0; i < (int)steps; i++){ //cast to int to compare steps to i
-        if (in_grid(x, y)){ //check that the values trying to be drawn to are within the grid
-            c->turtle->grid[(int)y][(int)x] = c->turtle->colour; //cast to int to plot on grid
+    if (sc->delay > 0){ //wait after drawing a line
+        struct timespec wait;
+        wait.tv_sec = (time_t)sc->delay;
+        wait.tv_nsec = (long)((sc->delay - wait.tv_sec) * 1e9);
+        while (nanosleep(&wait, &wait) != 0){ //keep sleeping if a signal cut the wait short
         }
-        x += xIncrement;
-        y += yIncrement; //increment x and y values to draw the next point on the line
     }
 }
 
-bool in_grid(int x, int y){
-    return (check_x(x) && check_y(y));
-}
+//remember the rows and columns a line touches so the next frame only has to look at them
+void screen_mark(Parser* c, long long x0, long long y0, long long x1, long long y1){
+    Screen* sc = &c->screen;
 
-bool check_x(int x){
-    if ((x >= 0) && (x < MAXWIDTH)){
-        return true;
+    if (!sc->started){
+        return; //the first frame redraws everything anyway
     }
-    return false;
-}
 
-bool check_y(int y){
-    if ((y >= 0) && (y < MAXHEIGHT)){
-        return true;
+    long long top = ((y0 < y1) ? y0 : y1) - sc->y; //box around the line in screen coordinates
+    long long bottom = ((y0 < y1) ? y1 : y0) - sc->y;
+    long long left = ((x0 < x1) ? x0 : x1) - sc->x;
+    long long right = ((x0 < x1) ? x1 : x0) - sc->x;
+
+    if (top < 0){
+        top = 0;
+    }
+    if (bottom >= sc->height){
+        bottom = sc->height - 1;
+    }
+    if (left < 0){
+        left = 0;
+    }
+    if (right >= sc->width){
+        right = sc->width - 1;
+    }
+
+    for (long long row = top; row <= bottom; row++){ //widen the changed span of each row
+        if (left < sc->dirty_min[row]){
+            sc->dirty_min[row] = left;
+        }
+        if (right > sc->dirty_max[row]){
+            sc->dirty_max[row] = right;
+        }
     }
-    return false;
 }
 
-int calc_steps(int dx, int dy){
-    int steps;
+//bring the terminal up to date, only cells that differ from what is already shown are written
+void screen_present(Parser* c){
+    Screen* sc = &c->screen;
+    long long x;
+    long long y;
+    int width;
+    int height;
 
-    if (abs(dx) > abs(dy)) {
-        steps = abs(dx);
-    } 
+    if (!output_region(c, &x, &y, &width, &height)){
+        return;
+    }
 
-    else {
-        steps = abs(dy);
+    if (!sc->started || (x != sc->x) || (y != sc->y) || (width != sc->width) || (height != sc->height)){
+        if (!screen_resize(c, x, y, width, height)){ //first frame, or a sparse canvas grew, so redraw it all
+            fail(c, TTL_ERR_MEMORY, "failed to allocate screen memory!");
+            return;
+        }
+        neillclrscrn(); ///clear screen
     }
 
-    return steps;
-}
+    sc->out_size = 0;
+    sc->colour = SCREEN_UNSET;
 
-void print_grid(Parser* c, FILE* wp){
-    for (int row = 0; row < MAXHEIGHT; row++){
-        for (int col = 0; col < MAXWIDTH; col++){
-            if (c->turtle->grid[row][col] == '\0'){
-                fprintf(wp, " ");
+    for (int row = 0; row < sc->height; row++){
+        int last = -2; //column the cursor is sitting after
+        if (sc->dirty_min[row] <= sc->dirty_max[row]){ //copy out the changed part of the row in one go
+            canvas_row(&c->turtle->grid, sc->x + sc->dirty_min[row], sc->y + row, sc->dirty_max[row] - sc->dirty_min[row] + 1, sc->row);
+        }
+        for (int col = sc->dirty_min[row]; col <= sc->dirty_max[row]; col++){
+            ColourCode cell = sc->row[col - sc->dirty_min[row]];
+            if (cell == sc->shown[(size_t)row * sc->width + col]){
+                continue;
             }
-            else {
-                fprintf(wp, "%c", c->turtle->grid[row][col]);
+
+            if (col != last + 1){ //jump the cursor over cells that haven't changed
+                screen_printf(sc, "\033[%d;%dH", row + 1, col + 1);
             }
+            screen_cell(sc, cell);
+            sc->shown[(size_t)row * sc->width + col] = cell;
+            last = col;
         }
-        fprintf(wp, "\n");
+        sc->dirty_min[row] = sc->width; //row is clean again
+        sc->dirty_max[row] = -1;
+    }
+
+    if (sc->out_of_memory){ //the frame couldn't be built
+        fail(c, TTL_ERR_MEMORY, "failed to allocate screen memory!");
+        return;
+    }
+
+    if (sc->out_size > 0){
+        screen_printf(sc, "\033[0m\033[%d;1H", sc->height + 1); //reset colours and park the cursor under the grid
+        fwrite(sc->out, 1, sc->out_size, stdout);
     }
+    fflush(stdout);
 }
 
-int find_var(char var){
-    int i = var - 'A';
-    if ((i >= 0) && (i < 26)){ //check that variable is an uppercase letter
-        return i;
+//make a frame log for options.record and write its header, NULL if the file can't be made
+FILE* ttl_record_open(const char* path){
+    FILE* log = fopen(path, "w");
+    if ((log != NULL) && (fprintf(log, "TTLLOG 1\n") < 0)){
+        fclose(log);
+        return NULL;
     }
-    return INVALID_VAR;
+    return log;
 }
 
-void print_screen(Parser* c){
-    neillclrscrn(); ///clear screen
-    // Iterate through the grid
-    for (int j = 0; j < MAXHEIGHT; j++) {
-        for (int i = 0; i < MAXWIDTH; i++) {
-            if (c->turtle->grid[j][i] == '\0'){
-                // Set the background colour
-                neillbgcol(BACKGROUND);
-                putchar(' '); //if null, print an emptyspace
+//add the lines drawn since the last frame to the frame log. the first frame, and any frame after a
+//sparse canvas grows, is a keyframe holding the whole region, every other frame only holds the
+//cells that changed. see README.md for the format
+void record_frame(Parser* c){
+    Screen* sc = &c->screen;
+    FILE* log = c->options.record;
+    long long x;
+    long long y;
+    int width;
+    int height;
+
+    if (!output_region(c, &x, &y, &width, &height)){
+        return;
+    }
+    if (width == 0){ //nothing drawn on a sparse canvas yet, start with the empty grid print_grid would write
+        width = c->turtle->grid.width;
+        height = c->turtle->grid.height;
+    }
+
+    if (!sc->started || (x != sc->x) || (y != sc->y) || (width != sc->width) || (height != sc->height)){
+        if (!screen_resize(c, x, y, width, height)){
+            fail(c, TTL_ERR_MEMORY, "failed to allocate screen memory!");
+            return;
+        }
+        fprintf(log, "K %lld %lld %d %d\n", x, y, width, height);
+        TTLStatus status = rle_rows(&c->turtle->grid, log, x, y, width, height);
+        if (status == TTL_ERR_MEMORY){
+            fail(c, TTL_ERR_MEMORY, "failed to allocate screen memory!");
+            return;
+        }
+        for (int row = 0; row < height; row++){ //the keyframe is what is shown now
+            canvas_row(&c->turtle->grid, x, y + row, width, sc->shown + (size_t)row * width);
+            sc->dirty_min[row] = width;
+            sc->dirty_max[row] = -1;
+        }
+    }
+    else {
+        fprintf(log, "F\n");
+        for (int row = 0; row < sc->height; row++){
+            int from = sc->dirty_min[row];
+            int to = sc->dirty_max[row];
+            if (from > to){
+                continue;
             }
-            else { //if a colour has been found
-                neillcol colour = find_neillcol(c->turtle->grid[j][i]);
-                neillfgcol(colour); //set colour
-                putchar(c->turtle->grid[j][i]);//print the value stored at turtle grid
+            char* shown = sc->shown + (size_t)row * sc->width;
+            canvas_row(&c->turtle->grid, sc->x + from, sc->y + row, to - from + 1, sc->row);
+            sc->dirty_min[row] = sc->width;
+            sc->dirty_max[row] = -1;
+
+            int first = from; //narrow the span down to the cells that really changed
+            while ((first <= to) && (shown[first] == sc->row[first - from])){
+                first++;
             }
-            neillreset();
+            if (first > to){
+                continue;
+            }
+            int last = to;
+            while (shown[last] == sc->row[last - from]){
+                last--;
+            }
+
+            memcpy(shown + first, sc->row + (first - from), last - first + 1);
+            size_t size = rle_row(shown + first, last - first + 1, sc->runs);
+            fprintf(log, "%d %d ", row, first);
+            fwrite(sc->runs, 1, size, log);
         }
-	printf("\n");
     }
-    neillbusywait(WAIT_TIME); //wait for a second after drawing a line
+
+    if (ferror(log)){
+        fail(c, TTL_ERR_IO, "failed to write to the frame log!");
+    }
 }
- 
 
-neillcol find_neillcol(char col){
-    if (col == 'K') {
-        return black; //return the appropriate neillcol for the character that was passed in
+//called every PUBLISH_CHECK_STEPS instructions, publishes what has been drawn since the last frame
+//once a frame is due. going by instructions rather than lines keeps frames coming for programs that
+//draw little, and reading the clock only every so often keeps it out of the hot loop. a signal stops
+//the run here too
+void publish_due(Parser* c){
+    Publisher* p = &c->publisher;
+    p->countdown = PUBLISH_CHECK_STEPS;
+    if (stop_signal != 0){
+        fail(c, TTL_ERR_INTERRUPTED, "interrupted!");
+        return;
+    }
+    if (!p->pending && (p->header != NULL)){ //nothing new, but the first check makes the ring so viewers can attach
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double since = (now.tv_sec - p->last_frame.tv_sec) + (now.tv_nsec - p->last_frame.tv_nsec) / 1e9;
+    if ((p->header == NULL) || (since >= 1.0 / c->options.fps)){
+        publish_frame(c, false);
     }
-    if (col == 'R') {
-        return red;
+}
+
+//copy the grid into the next slot of the shared memory ring for viewers. each slot is a seqlock: its sequence is odd while it is being written, so a
+//viewer that sees the same even sequence before and after copying knows it got a whole frame. the
+//writer never waits for viewers, a slow viewer just misses frames
+void publish_frame(Parser* c, bool last){
+    Publisher* p = &c->publisher;
+    clock_gettime(CLOCK_MONOTONIC, &p->last_frame);
+    p->pending = false;
+
+    long long x = c->options.viewport ? c->options.view_x : 0; //a sparse canvas publishes the part a dense one would have
+    long long y = c->options.viewport ? c->options.view_y : 0;
+    int width = c->options.viewport ? c->options.view_width : c->options.width;
+    int height = c->options.viewport ? c->options.view_height : c->options.height;
+
+    if ((p->header == NULL) || !samestr(p->name, c->options.publish) || (p->header->x != x) || (p->header->y != y) || (p->header->width != width) || (p->header->height != height)){
+        publish_close(c, false);
+        if (!publish_open(c, x, y, width, height)){
+            fail(c, TTL_ERR_IO, "failed to create the shared memory frame ring!");
+            return;
+        }
     }
-    if (col == 'G') {
-        return green;
+
+    ShmHeader* h = p->header;
+    uint64_t frame = atomic_load_explicit(&h->latest, memory_order_relaxed) + 1;
+    ShmSlot* slot = (ShmSlot*)((char*)h + h->header_size + (frame % h->slots) * h->slot_size);
+
+    uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed); //odd, being written
+    atomic_thread_fence(memory_order_release);
+
+    slot->frame = frame;
+    fill_cells(&c->turtle->grid, slot->cells, x, y, width, height);
+
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release); //even again, complete
+    atomic_store_explicit(&h->latest, frame, memory_order_release);
+    atomic_store_explicit(&h->finished, last, memory_order_release); //after latest, so a viewer that sees it also sees the last frame
+}
+
+//make the shared memory ring for a region of the canvas, named by --publish
+bool publish_open(Parser* c, long long x, long long y, int width, int height){
+    Publisher* p = &c->publisher;
+    size_t header_size = (sizeof(ShmHeader) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    size_t slot_size = (sizeof(ShmSlot) + (size_t)width * height + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    size_t size = header_size + slot_size * PUBLISH_SLOTS;
+
+    shm_unlink(c->options.publish); //a ring left by a run that was killed may still be mapped by viewers, never resize it under them
+    int fd = shm_open(c->options.publish, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0){
+        return false;
     }
-    if (col == 'B') {
-        return blue;
+    if (ftruncate(fd, size) != 0){ //a new object starts as zeros
+        close(fd);
+        shm_unlink(c->options.publish);
+        return false;
     }
-    if (col == 'Y') {
-        return yellow;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); //the mapping keeps the memory
+    if (map == MAP_FAILED){
+        shm_unlink(c->options.publish);
+        return false;
     }
-    if (col == 'C') {
-        return cyan;
+
+    ShmHeader* h = map;
+    h->version = SHM_VERSION;
+    h->x = x;
+    h->y = y;
+    h->width = width;
+    h->height = height;
+    h->slots = PUBLISH_SLOTS;
+    h->header_size = header_size;
+    h->slot_size = slot_size;
+    atomic_store_explicit(&h->magic, SHM_MAGIC, memory_order_release); //set last, viewers wait for it
+
+    p->header = h;
+    p->size = size;
+    snprintf(p->name, sizeof(p->name), "%s", c->options.publish);
+    return true;
+}
+
+//take the ring away, viewers that still have it mapped keep what they have. with finished set they
+//are told the run is over, even if it stopped before its last frame
+void publish_close(Parser* c, bool finished){
+    Publisher* p = &c->publisher;
+    if (p->header != NULL){
+        if (finished){
+            atomic_store_explicit(&p->header->finished, true, memory_order_release);
+        }
+        else {
+            atomic_store_explicit(&p->header->closed, true, memory_order_release); //viewers look the name up again
+        }
+        munmap(p->header, p->size);
+        shm_unlink(p->name);
+        p->header = NULL;
     }
-    if (col == 'M') {
-        return magenta;
+}
+
+//start tracking a new region of the canvas with nothing shown and every cell dirty
+bool screen_resize(Parser* c, long long x, long long y, int width, int height){
+    Screen* sc = &c->screen;
+
+    free(sc->shown);
+    free(sc->dirty_min);
+    free(sc->dirty_max);
+    free(sc->row);
+    free(sc->runs);
+    sc->shown = malloc((size_t)width * height + 1);
+    sc->row = malloc((size_t)width + 1);
+    sc->runs = malloc((size_t)width * RLE_RUN_SIZE + 1);
+    sc->dirty_min = malloc(((size_t)height + 1) * sizeof(int));
+    sc->dirty_max = malloc(((size_t)height + 1) * sizeof(int));
+    if ((sc->shown == NULL) || (sc->dirty_min == NULL) || (sc->dirty_max == NULL) || (sc->row == NULL) || (sc->runs == NULL)){
+        sc->width = 0; //nothing valid is shown any more
+        sc->height = 0;
+        sc->started = false;
+        return false;
     }
-    if (col == 'W') {
-        return white;
-    } 
-    else{
-        return white;
+
+    memset(sc->shown, SCREEN_UNSET, (size_t)width * height); //no cell matches this, so all of them get drawn
+    for (int row = 0; row < height; row++){
+        sc->dirty_min[row] = 0;
+        sc->dirty_max[row] = width - 1;
     }
+    sc->x = x;
+    sc->y = y;
+    sc->width = width;
+    sc->height = height;
+    sc->started = true;
+    return true;
 }
 
-void validVar(int i){
-    if (i == INVALID_VAR){ //check that an invalid variable hasnt been passed in 
-        fprintf(stderr, "invalid variable, please use an uppercase letter from A-Z\n");
-        exit(EXIT_FAILURE);
+//write one cell, only changing colour when it differs from the cell before it
+void screen_cell(Screen* sc, ColourCode cell){
+    if (cell != sc->colour){
+        if (cell == '\0'){
+            screen_printf(sc, "\033[0m\033[%dm", BACKGROUND + 10); // Set the background colour
+        }
+        else {
+            screen_printf(sc, "\033[0m\033[%dm", find_neillcol(cell)); //set colour
+        }
+        sc->colour = cell;
     }
-    return;
+    screen_printf(sc, "%c", (cell == '\0') ? ' ' : cell); //if null, print an emptyspace
 }
 
-void ask(char* instruction, char* answer){
+//append to the frame buffer, which is written to the terminal in one go
+void screen_printf(Screen* sc, const char* format, ...){
+    va_list args;
 
-    //colour is a special case because we want a valid colour and not a double value
-    if (samestr(instruction, "COLOUR")){
-        printf("Turtle doesn't know which colour pen to use!\n Please tell them which colour to use (remember to use quotation marks around tthe colour): ");
+    while (!sc->out_of_memory){
+        va_start(args, format);
+        int n = vsnprintf(sc->out + sc->out_size, sc->out_capacity - sc->out_size, format, args);
+        va_end(args);
 
-        if (scanf("%s", answer) != 1){
-            fprintf(stderr, "scanf failed!");
-            exit(EXIT_FAILURE);
+        if ((n >= 0) && ((size_t)n < sc->out_capacity - sc->out_size)){
+            sc->out_size += n;
+            return;
         }
 
-        if (!validword(answer)){
-            ask(instruction, answer); //if a valid word is not given recursively ask for a colour
+        size_t capacity = (sc->out_capacity == 0) ? OUTPUT_CHUNK : sc->out_capacity * 2;
+        char* out = realloc(sc->out, capacity);
+        if (out == NULL){
+            sc->out_of_memory = true; //picked up by screen_present
+            return;
         }
-        return;
+        sc->out = out;
+        sc->out_capacity = capacity;
     }
+}
 
-    if (samestr(instruction, "FORWARD")){
-        printf("Turtle doesn't know how far to travel!\n Please tell them how far to go: ");
+void screen_close(Parser* c){
+    if (c->screen.started){
+        neillreset(); //leave the terminal in its normal colours
     }
-    if (samestr(instruction, "RIGHT")){
-        printf("Turtle doesn't know which direction to turn!\n Please tell them where to face: ");
-    }
-    if (samestr(instruction, "TRIANGLE")){
-        printf("Turtle doesn't know what size your triangle should be!\n Please tell them what size to draw: ");
+    printf("\n");
+}
+ 
+
+bool validVar(Parser* c, int i){
+    if (i == INVALID_VAR){ //check that an invalid variable hasnt been passed in 
+        return fail(c, TTL_ERR_VARIABLE, "invalid variable, please use an uppercase letter from A-Z\n");
     }
-    if (samestr(instruction, "HEIGHT")){
-        printf("Turtle doesn't know how high your rectangle should be!\n Please tell them how high to go: ");
+    return true;
+}
+
+//get a missing number through the ask callback, the answer is checked here as well so a callback
+//can't slip an invalid value into the program
+bool ask_value(Parser* c, char* keyword, double* value){
+    char answer[MAXTOKENSIZE];
+
+    if ((c->options.publish != NULL) && c->publisher.pending){
+        publish_frame(c, false); //the answer may take a while, let viewers see what is drawn so far
     }
-    if (samestr(instruction, "WIDTH")){
-        printf("Turtle doesn't know how wide your rectangle should be!\n Please tell them how wide to go: ");
+    if ((c->options.ask == NULL) || !c->options.ask(c->options.ask_user, keyword, answer, sizeof(answer)) ||
+        !lex_number(answer, strlen(answer), value)){ //checks and converts the answer in one go
+        return fail(c, TTL_ERR_INPUT, "no valid value was given!");
     }
+    return true;
+}
 
-    if (scanf("%s", answer) != 1){
-        fprintf(stderr, "scanf failed!");
-        exit(EXIT_FAILURE);
+bool ask_colour(Parser* c, ColourCode* colour){
+    char answer[MAXTOKENSIZE];
+
+    if ((c->options.publish != NULL) && c->publisher.pending){
+        publish_frame(c, false);
     }
-    
-    if (!num(answer)){
-        ask(instruction, answer); //if a valid number hasn't been given, recursivly ask for one
+    if ((c->options.ask == NULL) || !c->options.ask(c->options.ask_user, "COLOUR", answer, sizeof(answer)) ||
+        ((*colour = assign_col(answer)) == '\0')){
+        return fail(c, TTL_ERR_INPUT, "no valid colour was given!");
+    }
+    return true;
+}
+
+//ask callback used by the command line, keeps asking at the terminal until the answer is valid
+bool ask(void* user, const char* instruction, char* answer, size_t size){
+    char format[16];
+    bool colour = samestr(instruction, "COLOUR"); //colour is a special case because we want a valid colour and not a double value
+    (void)user;
+    snprintf(format, sizeof(format), "%%%zus", size - 1); //never read more than the answer can hold
+
+    for (;;){ //keep asking until a valid answer is given
+        if (colour){
+            printf("Turtle doesn't know which colour pen to use!\n Please tell them which colour to use (remember to use quotation marks around tthe colour): ");
+        }
+        if (samestr(instruction, "FORWARD")){
+            printf("Turtle doesn't know how far to travel!\n Please tell them how far to go: ");
+        }
+        if (samestr(instruction, "RIGHT")){
+            printf("Turtle doesn't know which direction to turn!\n Please tell them where to face: ");
+        }
+        if (samestr(instruction, "TRIANGLE")){
+            printf("Turtle doesn't know what size your triangle should be!\n Please tell them what size to draw: ");
+        }
+        if (samestr(instruction, "HEIGHT")){
+            printf("Turtle doesn't know how high your rectangle should be!\n Please tell them how high to go: ");
+        }
+        if (samestr(instruction, "WIDTH")){
+            printf("Turtle doesn't know how wide your rectangle should be!\n Please tell them how wide to go: ");
+        }
+
+        if (scanf(format, answer) != 1){
+            fprintf(stderr, "scanf failed!");
+            return false;
+        }
+
+        if (colour ? validword(answer) : num(answer)){
+            return true;
+        }
     }
-    return;
 }
 
 
@@ -1,47 +1,180 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
 #include <math.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 
 #define READFILE 1
 #define WRITEFILE 2
 #define WAIT_TIME 1
-#define MAX_TOKENS 1000
+#define DEFAULT_FPS 60
+#define SCREEN_UNSET 1 //never a colour code, marks cells the terminal hasn't been sent yet
+#define TOKENS_START_SIZE 1024
+#define SOURCE_START_SIZE 4096
 #define MAXTOKENSIZE 100
-#define MAXWIDTH 51
-#define MAXHEIGHT 33
+#define DEFAULT_WIDTH 51
+#define DEFAULT_HEIGHT 33
+#define MAX_CANVAS_SIZE 16384
+#define MAX_POSITION 1099511627776.0 //2^40, the turtle stops this many cells from (0, 0) either way so positions fit in a long long
+#define CACHE_LINE 64
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+#define TILE_SLOTS_START 64
+#define OUTPUT_CHUNK (1 << 20)
+#define MAX_BATCH_WORKERS 1024
+#define DEFAULT_QUEUE_SIZE 64
+#define MAX_HEADER_SIZE 256
+#define MAX_REQUEST_SIZE (64 << 20)
 #define FWDANGLE 90
 #define DWNANGLE 270
 #define RGTANGLE 0
 #define LFTANGLE 180
+#undef M_PI
 #define M_PI 3.14159265
+#define FIXED_SHIFT 8 //--fixed positions are 24.8 fixed point
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_DEGREE 65536 //--fixed angles are in 1/65536ths of a degree
+#define FIXED_MAX_DISTANCE 1073741824.0 //longest single move in fixed point, keeps fixed_mul inside 64 bits
+#define HEADING_SHIFT 24 //--fixed headings are 8.24 fixed point
+#define CORDIC_SHIFT 30 //the rotations work in 2.30 fixed point
+#define CORDIC_STEPS 23
+#define CORDIC_GAIN 652032874 //1 / 1.6467602581 in 2.30, undoes the growth of CORDIC_STEPS rotations
+#define TRIG_RANGE 720 //whole degree headings in the trig table go from -TRIG_RANGE to TRIG_RANGE
 #define MAX_STACK_SIZE 100
 #define EMPTY_STACK -1
 #define VARIABLE_LIST 26
 #define INVALID_VAR -1
 #define samestr(A,B) (strcmp(A, B) == 0)
-#define INSTRUCTION c->instruction[c->cw]
-#define PRINT_INS printf("current instruction is: %s \n", INSTRUCTION);
-#define CURRENT_LOOP_INS c->variable[v].loop.current
+#define INSTRUCTION c->tokens[c->cw]
+#define TOKEN_TEXT token_text(c, INSTRUCTION)
+#define PRINT_INS printf("current instruction is: %.*s \n", (int)INSTRUCTION.length, TOKEN_TEXT);
+#define PROGRAM_START_SIZE 64
+#define CELL(g, x, y) ((g)->cells[(size_t)(y) * (g)->stride + (size_t)(x)])
+#define PACKED_BYTE(g, x, y) ((g)->cells[(size_t)(y) * (g)->stride + ((size_t)(x) >> 1)]) //even x in the low 4 bits
+#define PACKED_CODES 9 //empty and the 8 colours
+#define ERROR_MESSAGE_SIZE 128
+#define MAX_IMAGE_SCALE 64
+#define SHM_MAGIC 0x544C5446 //"FTLT", the ring is ready once this is set
+#define SHM_VERSION 2
+#define SHM_NAME_SIZE 256
+#define PUBLISH_SLOTS 4 //frames in the shared memory ring
+#define PUBLISH_CHECK_STEPS 256 //instructions run between looking at the clock for the next frame
+#define CELL_COLOURS "KRGBYCMW" //every colour a cell can be
+#define RLE_RUN_SIZE 12 //longest run in a TTLRLE row, a count up to INT_MAX and a colour
+#define DISPLAY_START_SIZE 1024
+#define RASTER_BAND_ROWS 64 //rows in each band the raster threads share out
 
 typedef char ColourCode;
 
-typedef struct Loop { 
-    int ins_start; //starting instruction
-    int ins_end; //ending instruction
-    int current; //instruction pointer
-    int instructions; //number of instructions in list
-    char loop_ins[MAXTOKENSIZE][MAXTOKENSIZE]; //instructions
-} Loop;
+typedef enum TTLStatus {
+    TTL_OK,
+    TTL_ERR_MEMORY,
+    TTL_ERR_IO, //reading the program or writing the grid failed
+    TTL_ERR_GRAMMAR,
+    TTL_ERR_LOOP_ITEMS,
+    TTL_ERR_POSTFIX,
+    TTL_ERR_VARIABLE, //not an uppercase letter from A-Z
+    TTL_ERR_STACK_OVERFLOW,
+    TTL_ERR_STACK_UNDERFLOW,
+    TTL_ERR_DIVIDE_BY_ZERO,
+    TTL_ERR_INPUT, //a missing value was asked for and no valid answer came back
+    TTL_ERR_INTERRUPTED //the command line was sent SIGINT or SIGTERM while publishing
+} TTLStatus;
+
+typedef struct TTLError {
+    TTLStatus status;
+    int token; //index of the token being worked on, -1 if the error isn't tied to one
+    int line; //line of that token, counted from 1, 0 if unknown
+    char message[ERROR_MESSAGE_SIZE];
+} TTLError;
+
+//called when the program leaves out a value, keyword is FORWARD, RIGHT, COLOUR, TRIANGLE, HEIGHT
+//or WIDTH. the answer is written as text into answer, return false if no answer can be given
+typedef bool (*TTLAsk)(void* user, const char* keyword, char* answer, size_t size);
+
+typedef enum TTLFormat {
+    TTL_FORMAT_TEXT, //one character a cell, a line a row
+    TTL_FORMAT_RLE, //TTLRLE, runs of colours, see print_grid_rle
+    TTL_FORMAT_PPM, //binary RGB image
+    TTL_FORMAT_PAM //binary RGB image with empty cells clear
+} TTLFormat;
+
+typedef struct TTLOptions {
+    int width; //size of the grid
+    int height;
+    bool sparse; //use an unbounded tiled canvas
+    bool packed; //dense only: 4 bits a cell instead of 8
+    bool legacy_raster; //use the floating point line drawing
+    bool fixed; //integer only turtle maths, the same on every machine
+    bool display_list; //record lines and draw them when the program has finished, not with the terminal
+    int raster_threads; //display list only: threads drawing a dense canvas, 0 or 1 draws on the calling thread
+    bool raster_bench; //command line only: time the display list drawn on 1 up to raster_threads threads
+    TTLFormat format; //how the grid is written out
+    int scale; //ppm and pam only: pixels across each cell, 0 or 1 for one pixel
+    bool mmap_output; //text only: write the output file through mmap
+    bool viewport; //only write out part of the canvas
+    long long view_x;
+    long long view_y;
+    int view_width;
+    int view_height;
+    bool screen; //draw on the terminal as the program runs
+    double fps; //terminal only: most frames per second
+    double delay; //terminal only: seconds to pause after each line
+    FILE* record; //write every line drawn to this frame log instead of the terminal, NULL for none. open it with ttl_record_open
+    const char* record_path; //command line only: where --record opens the frame log
+    const char* publish; //shared memory name, /name, to publish frames to for viewers, NULL for none
+    TTLAsk ask; //NULL means a missing value is an error
+    void* ask_user; //passed back to ask
+    bool stats; //command line only: print the parse and run times
+    bool rle_to_text; //command line only: convert a TTLRLE file to text instead of running a program
+} TTLOptions;
+
+typedef struct TTLStats {
+    int tokens;
+    int instructions; //compiled program size
+    double parse_seconds; //lexing and compiling
+    double run_seconds; //includes drawing the display list
+    long long segments; //display list only: lines left to draw once hidden ones were dropped
+} TTLStats;
+
+typedef enum TokenKind {
+    TOK_NAME, //keywords, letters, braces and operators
+    TOK_NUM,
+    TOK_VAR, //$ followed by an uppercase letter
+    TOK_WORD, //anything in double quotations
+    TOK_EOF //end of the program
+} TokenKind;
+
+typedef struct Token {
+    size_t offset; //where the token starts in the source
+    size_t length;
+    TokenKind kind;
+} Token;
 
 typedef struct Var {
     bool in_use; 
     double value; //use this if variable is a number
     ColourCode colour; //use this if variable is a colour
-    Loop loop; //use if assigned to a loop
 } Var;
 
 typedef struct Stack { 
@@ -51,43 +184,562 @@ typedef struct Stack {
 
 // typedef struct Postfix_Stack;
 
+typedef enum CanvasKind {
+    CANVAS_DENSE, //fixed size grid in one buffer
+    CANVAS_SPARSE //unbounded grid of tiles made on first write
+} CanvasKind;
+
+typedef struct Tile {
+    long long tx; //tile coordinates, the tile covers cells tx * TILE_SIZE onwards
+    long long ty;
+    char cells[TILE_SIZE * TILE_SIZE];
+} Tile;
+
+typedef struct Canvas {
+    CanvasKind kind;
+    int width;
+    int height;
+    bool packed; //dense only: two 4 bit cells to a byte, see PACKED_BYTE
+    int stride; //bytes from one row to the next, rows are padded to whole cache lines
+    char* cells; //one heap buffer of height rows, aligned to a cache line
+    Tile** tiles; //sparse only: open addressing index of the tiles drawn on
+    size_t tile_slots; //size of the index, always a power of two
+    size_t ntiles;
+    Tile* last; //most recently used tile
+    long long min_x; //sparse only: box around every cell drawn
+    long long min_y;
+    long long max_x;
+    long long max_y;
+    int band_top; //dense only: rows lines are drawn on, the whole grid except inside a raster thread
+    int band_bottom; //one past the last row
+    bool out_of_memory; //a tile couldn't be made, checked after each line
+} Canvas;
+
+typedef enum Opcode {
+    OP_FORWARD,
+    OP_RIGHT,
+    OP_COLOUR,
+    OP_SET,
+    OP_RECTANGLE,
+    OP_TRIANGLE,
+    OP_LOOP,
+    OP_RANGE, //LOOP over numbers from a to b
+    OP_END //closes the body of the matching OP_LOOP or OP_RANGE
+} Opcode;
+
+typedef enum OperandKind {
+    OPERAND_NUM, //number decoded at compile time
+    OPERAND_VAR, //variable, read when the instruction runs
+    OPERAND_COL, //colour decoded at compile time
+    OPERAND_ASK //no value in the program, ask the user when the instruction runs
+} OperandKind;
+
+typedef struct Operand {
+    OperandKind kind;
+    double num;
+    int var; //index into Parser::variable
+    ColourCode colour;
+} Operand;
+
+typedef enum ItemKind {
+    ITEM_NUM,
+    ITEM_VAR,
+    ITEM_COL,
+    ITEM_OP //SET only
+} ItemKind;
+
+//a loop list item or a SET expression item, decoded once when the program is compiled
+typedef struct Item {
+    ItemKind kind;
+    double num;
+    int var; //index into Parser::variable
+    ColourCode colour;
+    char op;
+    int token; //where it came from, for error reports
+} Item;
+
+typedef struct Code {
+    Opcode op;
+    Operand a; //distance, angle, colour, size, rectangle height or range start
+    Operand b; //rectangle width or range end
+    Operand step; //range step
+    int var; //variable assigned by SET and LOOP
+    int item; //first of the SET expression or LOOP list items in Program::items
+    int nitems;
+    int depth; //SET: most values the expression can push
+    int jump; //LOOP and RANGE: index of the matching END
+    int token; //keyword the instruction was compiled from, for error reports
+} Code;
+
+typedef struct Program {
+    Code* code; //compiled instructions
+    int size; //number of instructions emitted
+    int capacity; //number of instructions allocated
+    Item* items; //decoded SET expressions and LOOP lists
+    int nitems;
+    int items_capacity;
+} Program;
+
+//a loop that is running, kept on a stack so loops inside loops don't recurse
+typedef struct LoopFrame {
+    int pc; //index of the LOOP or RANGE instruction
+    long long next; //next list item, or how many range values have been used
+    double from; //range only
+    double to;
+    double step;
+} LoopFrame;
+
+//a line waiting to be drawn, its place in the display list is its sequence number
+typedef struct Segment {
+    long long x0; //relative to where the turtle started, so the list can be drawn on any canvas
+    long long y0;
+    long long x1; //end point, never plotted itself
+    long long y1;
+    ColourCode colour;
+} Segment;
+
+typedef struct DisplayList {
+    Segment* segments; //in the order they were drawn
+    size_t size;
+    size_t capacity;
+    size_t* slots; //open addressing table used to find duplicates, segment index + 1, 0 is free
+    size_t nslots;
+} DisplayList;
+
+typedef struct Screen {
+    bool started; //the terminal has been cleared and drawn on
+    double fps; //most frames per second
+    double delay; //seconds to pause after each line
+    struct timespec last_frame;
+    long long x; //part of the canvas on the terminal
+    long long y;
+    int width;
+    int height;
+    char* shown; //cells as they currently are on the terminal
+    char* row; //cells of the row being drawn, copied out of the canvas
+    char* runs; //frame log only: a changed span of a row written as runs
+    int* dirty_min; //columns of each row that may have changed since the last frame
+    int* dirty_max;
+    ColourCode colour; //colour the terminal is currently set to
+    char* out; //escape sequences and cells for the next frame
+    size_t out_size;
+    size_t out_capacity;
+    bool out_of_memory; //the frame buffer couldn't grow
+} Screen;
+
+//start of the shared memory ring made by --publish, read by ttl-viewer
+typedef struct ShmHeader {
+    _Atomic uint32_t magic; //SHM_MAGIC once everything below is filled in
+    uint32_t version;
+    int64_t x; //part of the canvas in every frame
+    int64_t y;
+    int32_t width;
+    int32_t height;
+    uint32_t slots; //frames in the ring
+    uint32_t header_size; //bytes before the first slot
+    uint64_t slot_size; //bytes from one slot to the next
+    _Atomic uint64_t latest; //newest complete frame, 0 before the first, it is in slot latest % slots
+    _Atomic bool finished; //the latest frame is the finished grid
+    _Atomic bool closed; //the writer has moved on to a new ring under the same name, the region changed
+} ShmHeader;
+
+//one frame of the ring
+typedef struct ShmSlot {
+    _Atomic uint64_t sequence; //odd while the writer is filling the slot
+    uint64_t frame;
+    char cells[]; //width * height cells a row at a time, null for empty
+} ShmSlot;
+
+//a frame log written by --record being played back, by ttl-replay and the tests
+typedef struct Replay {
+    FILE* in;
+    char* line; //line being worked on, from getline
+    size_t capacity;
+    bool pending; //line has been read but not used yet
+    long long x; //part of the canvas the log covers, from the last keyframe
+    long long y;
+    int width;
+    int height;
+    char* cells; //the grid as it is after the last frame, null for empty
+    long long frames; //frames played so far
+    bool screen; //draw each frame on the terminal
+} Replay;
+
+typedef struct Publisher {
+    ShmHeader* header; //mapped ring, NULL until the first frame
+    size_t size;
+    char name[SHM_NAME_SIZE];
+    struct timespec last_frame;
+    int countdown; //instructions left before the clock is read again
+    bool pending; //lines have been drawn since the last frame
+} Publisher;
+
 typedef struct Turtle {
     double y; // position of the tutle on the grid
     double x;
     double oldY; //save previous position for drawing function
     double oldX;
     double distance; //distance the turtle has to travel
-    double angle; //direction turtle is facing
+    double angle; //direction turtle is facing, only changed through turn_to
+    double heading_x; //cos and sin of angle
+    double heading_y;
+    bool fixed; //position and heading are kept in fixed point below
+    long long fx; //24.8 position
+    long long fy;
+    long long fixed_x; //8.24 cos and sin of angle
+    long long fixed_y;
     ColourCode colour; //colour pen the turtle is holding
-    char grid[MAXHEIGHT][MAXWIDTH]; //grid the turtle is on
+    Canvas grid; //grid the turtle is on
 } Turtle;
 
 typedef struct Parser {
-   char instruction[MAX_TOKENS][MAXTOKENSIZE];
+   const char* source; //text of the TTL file
+   size_t source_size;
+   bool mapped; //source is a memory mapped file rather than a heap copy
+   bool owned; //source is a heap copy the engine has to free
+   Token* tokens;
+   int ntokens;
+   int token_capacity;
    int cw;
-   int args;
+   TTLOptions options;
+   TTLError error; //first error of the current run
+   TTLStats stats;
    Turtle* turtle;
    Var variable[VARIABLE_LIST];
    Stack* stack;
+   Program program;
+   int* open; //loops being compiled whose END hasn't been reached, innermost last
+   int nopen;
+   int open_capacity;
+   LoopFrame* frames; //loops currently running, innermost last
+   int nframes;
+   int frame_capacity;
+   DisplayList display; //lines recorded with --display-list
+   bool watched; //the terminal, a frame log or a frame ring sees every line as it is drawn
+   Publisher publisher; //frame ring made with --publish
+   Screen screen;
 } Parser;
 
+//a display list shared out between raster threads a band of rows at a time
+typedef struct RasterBands {
+    Parser* engine;
+    size_t* starts; //band b draws the segments in bins from starts[b] up to starts[b + 1]
+    size_t* bins; //segment indexes, in sequence order within each band
+    int nbands;
+    int next; //next band no thread has taken yet
+    pthread_mutex_t lock; //guards next
+} RasterBands;
+
+typedef struct BatchJob {
+    char* path; //TTL file to render
+    double seconds; //time taken to read, run and write it
+    TTLError error;
+} BatchJob;
+
+struct Batch;
+
+typedef struct BatchWorker {
+    pthread_t thread;
+    pthread_mutex_t lock; //guards head and tail
+    int head; //next job this worker runs itself
+    int tail; //one past the last job, thieves take from here
+    int id;
+    struct Batch* batch;
+} BatchWorker;
+
+typedef struct Batch {
+    bool enabled; //picked with --batch
+    int nworkers; //threads in the pool, --jobs or one per core
+    BatchWorker* workers;
+    BatchJob* jobs;
+    int njobs;
+    int capacity;
+    TTLOptions options; //shared by every engine
+    const char* outdir;
+} Batch;
+
+typedef struct ServerJob {
+    TTLOptions options; //canvas asked for by the request
+    char* source;
+    size_t size;
+    char* output; //rendered grid, or nothing if the run failed
+    size_t output_size;
+    TTLError error;
+    bool done; //a worker has finished with it
+    struct ServerJob* next; //next job waiting for a worker
+    struct ServerJob* reply_next; //next job on the same connection
+} ServerJob;
+
+typedef struct Server {
+    bool serve; //picked with --serve
+    bool connect; //picked with --connect
+    const char* path; //socket
+    int fd;
+    int nworkers;
+    int capacity; //most jobs waiting in the queue, picked with --queue
+    int queued;
+    ServerJob* head; //queue of jobs waiting for a worker
+    ServerJob* tail;
+    pthread_mutex_t lock; //guards the queue and every connection's replies
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t done;
+    TTLOptions defaults;
+} Server;
+
+typedef struct Connection {
+    int fd;
+    Server* server;
+    ServerJob* first; //replies still to send, oldest first
+    ServerJob* last;
+    bool finished; //no more requests will come in
+} Connection;
+
+typedef struct ClientSend {
+    int fd;
+    Batch* batch; //files to send
+    TTLOptions options;
+    int status;
+} ClientSend;
+
+//everything one program run needs, engines share nothing so each thread can have its own
+typedef struct Parser TTLEngine;
+
+void ttl_default_options(TTLOptions* options);
+
+TTLEngine* ttl_engine_create(const TTLOptions* options);
+
+TTLStatus ttl_engine_set_options(TTLEngine* engine, const TTLOptions* options);
+
+TTLStatus ttl_engine_run(TTLEngine* engine, const char* source, size_t size, TTLError* error);
+
+TTLStatus ttl_engine_run_file(TTLEngine* engine, FILE* fp, TTLError* error);
+
+TTLStatus ttl_engine_write(TTLEngine* engine, FILE* wp, TTLError* error);
+
+TTLStatus ttl_engine_redraw(TTLEngine* engine, const TTLOptions* options, TTLError* error);
+
+void ttl_engine_stats(TTLEngine* engine, TTLStats* stats);
+
+Canvas* ttl_engine_canvas(TTLEngine* engine);
+
+void ttl_engine_destroy(TTLEngine* engine);
+
+const char* ttl_status_string(TTLStatus status);
+
+FILE* ttl_record_open(const char* path);
+
+void print_stats(TTLEngine* c);
+
+double elapsed(struct timespec start);
+
+void engine_reset(Parser* c);
+
+TTLStatus engine_finish(Parser* c, TTLError* error);
+
+bool fail(Parser* c, TTLStatus status, const char* message);
+
+void free_source(Parser* c);
+
+bool canvas_init(Canvas* g, int width, int height, bool packed);
+
+bool sparse_init(Canvas* g, int width, int height);
+
+void canvas_clear(Canvas* g);
+
+void canvas_free(Canvas* g);
+
+void canvas_plot(Canvas* g, long long x, long long y, ColourCode colour);
+
+void packed_init(void);
+
+void packed_set(Canvas* g, long long x, long long y, ColourCode colour);
+
+ColourCode packed_get(Canvas* g, long long x, long long y);
+
+void packed_fill(Canvas* g, long long y, long long from, long long to, ColourCode colour);
+
+void packed_row(Canvas* g, long long x, long long y, long long n, char* dst);
+
+Tile* find_tile(Canvas* g, long long tx, long long ty, bool create);
+
+bool grow_tiles(Canvas* g);
+
+long long tile_of(long long v);
+
+int tile_offset(long long v);
+
+size_t tile_cell(long long x, long long y);
+
+size_t tile_hash(long long tx, long long ty);
+
+bool output_region(Parser* c, long long* x, long long* y, int* width, int* height);
+
 void on_error(Parser* c, FILE* fp, FILE* wp, int argc);
 
-void load_ins(Parser* c, FILE* fp);
+int parse_options(TTLOptions* o, Batch* b, Server* sv, int argc, char** argv);
+
+int run_batch(Batch* b, const TTLOptions* options, const char* list, const char* outdir);
+
+void* batch_worker(void* arg);
+
+bool batch_next(BatchWorker* worker, int* job);
+
+bool batch_steal(BatchWorker* worker, int* job);
+
+void batch_run_job(Batch* b, TTLEngine* engine, BatchJob* job);
+
+void batch_output_name(Batch* b, const char* path, char* out, size_t size);
+
+bool batch_add(Batch* b, const char* path);
+
+bool batch_load_manifest(Batch* b, const char* list);
+
+bool batch_load_dir(Batch* b, const char* dir);
+
+void batch_free(Batch* b);
+
+int run_server(Server* sv, const TTLOptions* options, int nworkers);
+
+void* server_worker(void* arg);
+
+void* connection_reader(void* arg);
+
+void* connection_writer(void* arg);
+
+ServerJob* read_request(Server* sv, FILE* in);
+
+const char* local_option(const TTLOptions* o);
+
+int run_client(Server* sv, const TTLOptions* options, int nfiles, char** files, bool batch);
+
+void* client_send(void* arg);
+
+bool client_receive(FILE* in, Batch* b, int i, const char* out);
+
+bool socket_address(const char* path, struct sockaddr_un* address);
+
+bool write_full(int fd, const char* data, size_t size);
+
+bool read_file(const char* path, char** data, size_t* size);
+
+bool load_ins(Parser* c, FILE* fp);
+
+bool read_source(Parser* c, FILE* fp);
+
+TTLStatus read_stream(FILE* fp, char** data, size_t* size);
+
+bool lex(Parser* c);
+
+bool add_token(Parser* c, size_t offset, size_t length, TokenKind kind);
+
+TokenKind token_kind(const char* text, size_t length);
+
+bool lex_number(const char* text, size_t length, double* value);
+
+const char* token_text(Parser* c, Token t);
+
+bool token_is(Parser* c, Token t, char* s);
+
+double token_num(Parser* c, Token t);
+
+ColourCode token_col(Parser* c, Token t);
+
+bool stack_init(Parser* c);
+
+bool turtle_init(Parser* c);
+
+void turtle_reset(Parser* c);
+
+void trig_init(void);
+
+void turn_to(Turtle* t, double angle);
+
+void fixed_heading(double angle, long long* cos_out, long long* sin_out);
 
-void stack_init(Parser* c);
+void calc_position_fixed(Turtle* t);
 
-void turtle_init(Parser* c);
+long long fixed_position(long long f);
 
-void print_grid(Parser* c, FILE* wp);
+long long fixed_mul(long long heading, long long distance);
+
+bool print_grid(Parser* c, FILE* wp);
+
+bool print_grid_mmap(Parser* c, FILE* wp, long long x, long long y, int width, int height);
+
+bool print_grid_rle(Parser* c, FILE* wp, long long x, long long y, int width, int height);
+
+TTLStatus rle_rows(Canvas* g, FILE* wp, long long x, long long y, int width, int height);
+
+size_t rle_row(const char* cells, int width, char* out);
+
+int empty_run(const char* cells, int n);
+
+bool rle_to_text(FILE* in, FILE* out);
+
+int rle_decode(const char* line, char* cells, int width, char empty, bool fill);
+
+void draw_cells(const char* cells, int row, int col, int n);
+
+bool write_cells(FILE* wp, const char* cells, int width, int height);
+
+bool replay_open(Replay* r, FILE* in);
+
+bool replay_next(Replay* r, bool* done);
+
+bool replay_keyframe(Replay* r);
+
+bool replay_delta(Replay* r);
+
+bool read_line(Replay* r);
+
+bool print_grid_image(Parser* c, FILE* wp, long long x, long long y, int width, int height);
+
+const char* format_extension(TTLFormat format);
+
+void fill_cells(Canvas* g, char* dst, long long x, long long y, int width, int height);
+
+void fill_rows(Canvas* g, char* dst, long long x, long long y, int width, int rows);
+
+void canvas_row(Canvas* g, long long x, long long y, int width, char* dst);
+
+void blank_cells(char* cells, size_t size);
 
 void print_screen(Parser* c);
 
+void screen_mark(Parser* c, long long x0, long long y0, long long x1, long long y1);
+
+void screen_present(Parser* c);
+
+void record_frame(Parser* c);
+
+void publish_due(Parser* c);
+
+void publish_frame(Parser* c, bool last);
+
+bool publish_open(Parser* c, long long x, long long y, int width, int height);
+
+void publish_close(Parser* c, bool finished);
+
+void stop_publishing(int sig);
+
+void stopped(void);
+
+bool screen_resize(Parser* c, long long x, long long y, int width, int height);
+
+void screen_cell(Screen* sc, ColourCode cell);
+
+void screen_printf(Screen* sc, const char* format, ...);
+
+void screen_close(Parser* c);
+
 void parser_free(Parser* c);
 
 bool prog(Parser* c);
 
-bool inslst(Parser* c);
+bool open_loop(Parser* c, int at);
+
+bool close_loop(Parser* c);
 
 bool ins(Parser* c);
 
@@ -101,9 +753,7 @@ bool loop(Parser* c);
 
 bool rectangle(Parser* c);
 
-bool rectangle_setup(Parser* c, double* h, double* w);
-
-bool check_dimensions(Parser* c, double* dimension, char* answer);
+bool rectangle_setup(Parser* c, Code* code);
 
 void draw_rectangle(Parser* c, double height, double width);
 
@@ -111,43 +761,80 @@ bool triangle(Parser* c);
 
 void draw_triangle(Parser* c);
 
-void ask(char* instruction, char* answer);
+bool ask(void* user, const char* instruction, char* answer, size_t size);
 
-void loopsetup(Parser* c, int v);
+bool ask_value(Parser* c, char* keyword, double* value);
 
-void exec_loop(Parser* c, int v);
+bool ask_colour(Parser* c, ColourCode* colour);
 
-bool assign_loop_var(Parser* c, int v);
+bool assign_loop_var(Parser* c, int v, Item* item);
 
-bool set(Parser* c);
+Code* emit(Parser* c, Opcode op);
 
-void set_interp(Parser* c, int v);
+Item* add_item(Parser* c);
 
-double apply_operation(double operand1, double operand2, char operator);
+bool loop_items(Parser* c, Code* code, int brace);
 
-void push(Parser* c, double item);
+bool set_items(Parser* c, Code* code, int from);
 
-double pop(Parser* c);
+bool fold(double operand1, double operand2, char operator, double* result);
+
+bool operand(Parser* c, Operand* o);
+
+bool colour_operand(Parser* c, Operand* o);
+
+void run(Parser* c);
 
-bool is_stack_empty(Parser* c);
 
-bool varnum(char* instruction);
+bool operand_value(Parser* c, Operand* o, char* keyword, double* value);
 
-bool var(char* variable);
+void exec_fwd(Parser* c, Code* code);
+
+void exec_rgt(Parser* c, Code* code);
+
+void exec_col(Parser* c, Code* code);
+
+void exec_set(Parser* c, Code* code);
+
+void exec_rectangle(Parser* c, Code* code);
+
+void exec_triangle(Parser* c, Code* code);
+
+int exec_loop(Parser* c, int pc);
+
+int exec_range(Parser* c, int pc);
+
+int loop_next(Parser* c);
+
+LoopFrame* push_frame(Parser* c, int pc);
+
+bool range(Parser* c, int v);
+
+bool range_operand(Parser* c, Operand* o);
+
+bool set(Parser* c);
+
+bool set_interp(Parser* c, Code* code);
+
+bool apply_operation(Parser* c, double operand1, double operand2, char operator, double* result);
+
+bool push(Parser* c, double item);
+
+bool pop(Parser* c, double* item);
+
+bool is_stack_empty(Parser* c);
 
 bool num(char* number);
 
 bool ltr(char c);
 
-bool word(char* instruction);
-
 bool lst(Parser* c);
 
 bool items(Parser* c);
 
 bool item(Parser* c);
 
-void validVar(int i);
+bool validVar(Parser* c, int i);
 
 bool pfix(Parser* c);
 
@@ -155,15 +842,55 @@ bool op(char op);
 
 void calc_position(Parser* c);
 
+double move_position(double position, double move);
+
 void draw_line(Parser* c);
 
+void draw_segment(Parser* c, Canvas* g, long long x0, long long y0, long long x1, long long y1, ColourCode colour);
+
+bool span_line(Canvas* g, long long x0, long long y0, long long x1, long long y1, ColourCode colour);
+
+void span_sparse(Canvas* g, bool across, long long fixed, long long low, long long high, ColourCode colour);
+
+void raster_line(Canvas* g, long long x0, long long y0, long long x1, long long y1, ColourCode colour);
+
+void raster_step(long long* q, long long* r, long long d, long long steps);
+
+bool narrow_axis(long long p0, long long d, long long steps, long long low, long long high, long long* first, long long* last);
+
+long long raster_point(long long p0, long long d, long long steps, long long i);
+
+bool clip_axis(long long p0, long long d, long long steps, long long size, long long* first, long long* last);
+
+long long floor_div(long long a, long long b);
+
+__int128 floor_div_wide(__int128 a, long long b);
+
+void draw_line_dda(Canvas* g, double x0, double y0, double x1, double y1, ColourCode colour);
+
+bool display_add(Parser* c, long long x0, long long y0, long long x1, long long y1, ColourCode colour);
+
+bool display_compact(DisplayList* d);
+
+size_t segment_hash(Segment* s);
+
+void display_render(Parser* c);
+
+bool display_render_bands(Parser* c);
+
+void* raster_worker(void* arg);
+
+void raster_bench(Parser* c, int most);
+
 int calc_steps(int dy, int dx);
 
-bool in_grid(int x, int y);
+bool dda_fits(long long x, long long y);
 
-bool check_x(int x);
+bool in_grid(Canvas* g, int x, int y);
 
-bool check_y(int y);
+bool check_x(Canvas* g, int x);
+
+bool check_y(Canvas* g, int y);
 
 int find_var(char var);
 
@@ -173,5 +900,7 @@ bool validword(char* w);
 
 char assign_col(char* colour);
 
+ColourCode colour_code(const char* colour, size_t length);
+
 void test();
 